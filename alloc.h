@@ -3,11 +3,31 @@
 namespace pbbs {
   void* my_alloc(size_t);
   void my_free(void*);
+  // as above, but not counted by ALLOC_STATS, for the allocators' own pools
+  void* my_alloc_internal(size_t);
+  void my_free_internal(void*);
 }
 
 #include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <vector>
+#if defined(ALLOC_STATS)
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#endif
 #include <new>
+#include <sys/mman.h>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 #include "utilities.h"
 #include "concurrent_stack.h"
 #include "utilities.h"
@@ -22,6 +42,116 @@ namespace pbbs {
 #endif
 
 
+  // ****************************************
+  //    large_pages
+  // ****************************************
+
+  // Large blocks are mapped directly with mmap.  The environment
+  // variable HUGE_PAGES selects the pages used for them:
+  //   unset : normal pages
+  //   thp   : transparent huge pages (madvise MADV_HUGEPAGE), and blocks
+  //           of at least 2MB are aligned to 2MB so they can be used
+  //   2M    : explicit 2MB pages (MAP_HUGETLB)
+  //   1G    : explicit 1GB pages (MAP_HUGETLB)
+  // Explicit pages are only used for blocks of at least one of them,
+  // smaller blocks are mapped as with thp.  They have to be reserved by
+  // the system (e.g. in /proc/sys/vm/nr_hugepages), otherwise normal
+  // pages are used, mapping the same length.
+  struct large_pages {
+    enum kind { normal, thp, huge_2m, huge_1g };
+
+    static kind mode() {
+      static kind m = [] {
+	const char* s = std::getenv("HUGE_PAGES");
+	if (s == NULL || *s == 0) return normal;
+	if (std::strcmp(s, "thp") == 0) return thp;
+	if (std::strcmp(s, "2M") == 0) return huge_2m;
+	if (std::strcmp(s, "1G") == 0) return huge_1g;
+	throw std::invalid_argument("HUGE_PAGES should be thp, 2M or 1G");
+      }();
+      return m;
+    }
+
+    static constexpr size_t small_page = ((size_t) 1) << 12;
+    static constexpr size_t thp_size = ((size_t) 1) << 21;
+
+    // log of the size of explicit huge pages, or 0 if not used
+    static int log_huge_page() {
+      switch (mode()) {
+      case huge_2m: return 21;
+      case huge_1g: return 30;
+      default: return 0;
+      }
+    }
+
+    // the page size used for a block of n bytes
+    static size_t page_size(size_t n) {
+      int log_size = log_huge_page();
+      if (log_size > 0 && n >= (((size_t) 1) << log_size))
+	return ((size_t) 1) << log_size;
+      return small_page;
+    }
+
+    // the stride for touching every page of a block of n bytes
+    static size_t touch_stride(size_t n) {
+      size_t p = page_size(n);
+      if (p == small_page && mode() != normal && n >= thp_size) return thp_size;
+      return p;
+    }
+
+    // the bytes mapped for a block of n bytes
+    static size_t mapped_size(size_t n) {
+      size_t p = page_size(n);
+      return (n + p - 1) / p * p;
+    }
+
+    static void* map(size_t n) {
+      size_t len = mapped_size(n);
+      int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+      void* a = MAP_FAILED;
+#if defined(MAP_HUGETLB) && defined(MAP_HUGE_SHIFT)
+      if (page_size(n) > small_page)
+	a = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		 flags | MAP_HUGETLB | (log_huge_page() << MAP_HUGE_SHIFT), -1, 0);
+#endif
+      if (a != MAP_FAILED) return a;
+      size_t align = thp_size;
+      if (mode() == normal || len < align) {
+	a = mmap(NULL, len, PROT_READ | PROT_WRITE, flags, -1, 0);
+	if (a == MAP_FAILED) throw std::bad_alloc();
+	return a;
+      }
+      // over map, and trim to get an aligned block
+      char* b = (char*) mmap(NULL, len + align, PROT_READ | PROT_WRITE, flags, -1, 0);
+      if (b == MAP_FAILED) throw std::bad_alloc();
+      char* r = (char*) (((uintptr_t) b + align - 1) & ~(align - 1));
+      if (r > b) munmap(b, r - b);
+      if (r + len < b + len + align) munmap(r + len, (b + len + align) - (r + len));
+#if defined(MADV_HUGEPAGE)
+      madvise(r, len, MADV_HUGEPAGE);
+#endif
+      return r;
+    }
+
+    static void unmap(void* a, size_t n) {
+      munmap(a, mapped_size(n));
+    }
+
+    // Spreads the pages of a block round robin over the NUMA nodes the
+    // process may use, before they are touched.  Does nothing if the
+    // system does not support it.
+    static void interleave([[maybe_unused]] void* a, [[maybe_unused]] size_t n) {
+#if defined(__linux__) && defined(SYS_mbind) && defined(SYS_get_mempolicy)
+      const int mpol_interleave = 3, mpol_f_mems_allowed = 4;
+      const unsigned long max_node = 1024;
+      unsigned long mask[max_node / (8 * sizeof(unsigned long))] = {};
+      if (syscall(SYS_get_mempolicy, NULL, mask, max_node, NULL,
+		  mpol_f_mems_allowed) != 0) return;
+      syscall(SYS_mbind, a, mapped_size(n), mpol_interleave, mask, max_node, 0);
+#endif
+    }
+  };
+
   // ****************************************
   //    pool_allocator
   // ****************************************
@@ -32,21 +162,168 @@ namespace pbbs {
   // For pools of small blocks (below large_threshold) each thread keeps a
   //   thread local list of elements from each pool using the
   //   block_allocator.
-  // For pools of large blocks there is only one shared pool for each.
+  // For pools of large blocks there is a shared pool for each size on
+  //   each NUMA node (see worker_node), and the blocks are mapped with
+  //   mmap (see large_pages).  A freed block goes to the pool of the
+  //   node of the worker freeing it, and allocation takes from the pool
+  //   of its own node first.  Each worker also caches a few recently
+  //   freed large blocks of up to worker_cache_max bytes, which it
+  //   reuses first without touching the shared pools.  Blocks of at
+  //   least the interleave
+  //   threshold (set_interleave_threshold, none by default) are instead
+  //   interleaved over all nodes and kept in a pool shared by all nodes.
+  // Freed large blocks are cached for reuse.  The cache is bounded by
+  //   set_large_cache_limit (freed blocks that do not fit are unmapped),
+  //   and blocks that have been in it for longer than the decay time
+  //   (set_large_cache_decay) are unmapped by trim, which is also called
+  //   by deallocate every decay period.  trim also empties the worker
+  //   caches.
+  // The pool of a size is found in constant time by looking up its
+  //   size class (see size_class) in a table, and stepping over at most
+  //   the few pools within the class.
   struct pool_allocator {
 
   private:
-    static const size_t large_align = 64;
     static const size_t large_threshold = (1 << 20);
     size_t num_buckets;
     size_t num_small;
     size_t max_small;
     size_t max_size;
     std::atomic<long> large_allocated{0};
-  
-    concurrent_stack<void*>* large_buckets;
+    std::atomic<long> large_cached{0};
+    std::atomic<long> large_trimmed{0};
+    std::atomic<size_t> large_cache_limit{~((size_t) 0)};
+    std::atomic<double> large_cache_decay{0.0}; // seconds, 0 for never
+    std::atomic<double> last_trim{0.0};
+
+    struct cached_block {
+      void* ptr;
+      double freed; // time it was freed
+    };
+
+    // large bucket i (from num_small) of pool p (a node, or num_nodes
+    // for interleaved blocks) is large_buckets[p*num_large + i-num_small]
+    concurrent_stack<cached_block>* large_buckets;
+    int num_nodes;
+    size_t num_large;
+    std::atomic<size_t> interleave_threshold{~((size_t) 0)};
     struct block_allocator *small_allocators;
     std::vector<size_t> sizes;
+    std::vector<size_t> class_bucket; // first bucket that can be in each class
+
+    // Size classes are 16, 32, 48 and 64 bytes and then four per power
+    // of two, each a quarter of the power apart.
+    static size_t size_class(size_t n) {
+      if (n <= 64) return (n > 0) ? (n - 1) / 16 : 0;
+      size_t k = 63 - __builtin_clzl(n - 1); // 2^k < n <= 2^(k+1)
+      return 4 * (k - 5) + (n - 1 - (((size_t) 1) << k)) / (((size_t) 1) << (k - 2));
+    }
+
+    static size_t class_size(size_t c) {
+      if (c < 4) return 16 * (c + 1);
+      size_t k = c / 4 + 5;
+      return (((size_t) 1) << k) + (c % 4 + 1) * (((size_t) 1) << (k - 2));
+    }
+
+    // the smallest bucket that fits n, for n <= max_size
+    size_t find_bucket(size_t n) {
+      size_t bucket = class_bucket[size_class(n)];
+      while (n > sizes[bucket]) bucket++;
+      return bucket;
+    }
+
+    // A few recently freed large blocks for each worker.  The bucket is
+    // kept in the low bits of the (page aligned) pointer, so a slot is
+    // taken or filled by a single atomic operation, also by trim.  The
+    // time a block was freed is set before its slot, so trim by age does
+    // not take blocks that were just cached.
+    static const size_t worker_cache_slots = 4;
+    static const size_t worker_cache_max = (1 << 24);
+    struct alignas(128) worker_cache {
+      std::atomic<size_t> slots[worker_cache_slots];
+      std::atomic<double> freed[worker_cache_slots];
+      std::atomic<size_t> next{0}; // slot to evict
+      worker_cache() {
+	for (auto& s : slots) s = 0;
+	for (auto& f : freed) f = 0.0;
+      }
+    };
+    worker_cache* worker_caches = NULL;
+    int num_worker_caches = 0;
+
+    worker_cache& own_cache() {
+      return worker_caches[worker_id() % num_worker_caches];
+    }
+
+    bool worker_cacheable(size_t size) {
+      return size <= worker_cache_max && !interleaved(size);
+    }
+
+    void* take_from_worker_cache(size_t bucket) {
+      worker_cache& wc = own_cache();
+      for (auto& s : wc.slots) {
+	size_t v = s.load(std::memory_order_relaxed);
+	if (v != 0 && (v & 4095) == bucket && s.compare_exchange_strong(v, 0)) {
+	  large_cached -= mapped(bucket);
+	  return (void*) (v - bucket);
+	}
+      }
+      return NULL;
+    }
+
+    // returns a block evicted to make room, if any, and when it was freed
+    size_t put_in_worker_cache(void* ptr, size_t bucket, double t,
+			       double& evicted_freed) {
+      worker_cache& wc = own_cache();
+      size_t v = ((size_t) ptr) + bucket;
+      for (size_t j = 0; j < worker_cache_slots; j++) {
+	size_t empty = 0;
+	if (wc.slots[j].load(std::memory_order_relaxed) == 0) {
+	  wc.freed[j] = t;
+	  if (wc.slots[j].compare_exchange_strong(empty, v)) return 0;
+	}
+      }
+      size_t j = wc.next++ % worker_cache_slots;
+      evicted_freed = wc.freed[j].exchange(t);
+      return wc.slots[j].exchange(v);
+    }
+
+    // unmaps the blocks in the worker caches freed at or before the
+    // cutoff, returning their mapped bytes
+    size_t clear_worker_caches(double cutoff = HUGE_VAL) {
+      size_t total = 0;
+      for (int i = 0; i < num_worker_caches; i++)
+	for (size_t j = 0; j < worker_cache_slots; j++) {
+	  std::atomic<size_t>& s = worker_caches[i].slots[j];
+	  size_t v = s.load();
+	  if (v == 0 || worker_caches[i].freed[j] > cutoff ||
+	      !s.compare_exchange_strong(v, 0))
+	    continue;
+	  size_t bucket = v & 4095;
+	  large_cached -= mapped(bucket);
+	  total += mapped(bucket);
+	  unmap_large((void*) (v - bucket), sizes[bucket]);
+	}
+      return total;
+    }
+
+    static double now() {
+      using namespace std::chrono;
+      return duration<double>(steady_clock::now().time_since_epoch()).count();
+    }
+
+    concurrent_stack<cached_block>& large_bucket(int pool, size_t i) {
+      return large_buckets[pool * num_large + i - num_small];
+    }
+
+    bool interleaved(size_t size) {
+      return size >= interleave_threshold;
+    }
+
+    // the pool a block of the given size is freed to
+    int home_pool(size_t size) {
+      return interleaved(size) ? num_nodes : worker_node() % num_nodes;
+    }
 
     void* allocate_large(size_t n) {
 
@@ -54,27 +331,69 @@ namespace pbbs {
       size_t alloc_size;
 
       if (n <= max_size) {
-	while (n > sizes[bucket]) bucket++;
-	maybe<void*> r = large_buckets[bucket-num_small].pop();
-	if (r) return *r;
+	bucket = find_bucket(n);
 	alloc_size = sizes[bucket];
+	if (worker_cacheable(alloc_size)) {
+	  void* r = take_from_worker_cache(bucket);
+	  if (r != NULL) return r;
+	}
+	// own node first, then the others
+	int home = home_pool(alloc_size);
+	int tries = (home == num_nodes) ? 1 : num_nodes;
+	for (int j = 0; j < tries; j++) {
+	  int pool = (home == num_nodes) ? home : (home + j) % num_nodes;
+	  maybe<cached_block> r = large_bucket(pool, bucket).pop();
+	  if (r) {
+	    large_cached -= mapped(bucket);
+	    return (*r).ptr;
+	  }
+	}
       } else alloc_size = n;
+      return map_large(alloc_size);
+    }
 
-      void* a = (void*) aligned_alloc(large_align, alloc_size);
-      if (a == NULL) throw std::bad_alloc();
-      
-      large_allocated += n;
+    // maps a new block, not taken from the caches
+    void* map_large(size_t size) {
+      void* a = large_pages::map(size);
+      if (interleaved(size)) large_pages::interleave(a, size);
+      large_allocated += large_pages::mapped_size(size);
       return a;
     }
 
+    void unmap_large(void* ptr, size_t n) {
+      large_pages::unmap(ptr, n);
+      large_allocated -= large_pages::mapped_size(n);
+    }
+
+    // the bytes mapped for a block of a large bucket
+    size_t mapped(size_t bucket) {
+      return large_pages::mapped_size(sizes[bucket]);
+    }
+
     void deallocate_large(void* ptr, size_t n) {
-      if (n > max_size) { 
-	free(ptr);
-	large_allocated -= n;
-      } else {
-	size_t bucket = num_small;
-	while (n > sizes[bucket]) bucket++;
-	large_buckets[bucket-num_small].push(ptr);
+      if (n > max_size) unmap_large(ptr, n);
+      else {
+	size_t bucket = find_bucket(n);
+	size_t size = sizes[bucket];
+	if ((size_t) (large_cached += mapped(bucket)) > large_cache_limit) {
+	  large_cached -= mapped(bucket);
+	  large_trimmed += mapped(bucket);
+	  unmap_large(ptr, size);
+	} else if (worker_cacheable(size)) {
+	  // an evicted block goes to the shared pool
+	  double freed;
+	  size_t v = put_in_worker_cache(ptr, bucket, now(), freed);
+	  if (v != 0) {
+	    size_t b = v & 4095;
+	    large_bucket(home_pool(sizes[b]), b).push(cached_block{(void*) (v - b), freed});
+	  }
+	} else large_bucket(home_pool(size), bucket).push(cached_block{ptr, now()});
+      }
+      double decay = large_cache_decay;
+      if (decay > 0) {
+	double t = now(), last = last_trim;
+	if (t - last > decay && last_trim.compare_exchange_strong(last, t))
+	  trim(decay);
       }
     }
 
@@ -87,6 +406,7 @@ namespace pbbs {
       free(small_allocators);
       clear();
       delete[] large_buckets;
+      delete[] worker_caches;
     }
 
     pool_allocator() {}
@@ -100,7 +420,20 @@ namespace pbbs {
 	num_small++;
       max_small = (num_small > 0) ? sizes[num_small - 1] : 0;
 
-      large_buckets = new concurrent_stack<void*>[num_buckets-num_small];
+      num_nodes = std::max(1, num_worker_nodes());
+      num_large = num_buckets - num_small;
+      large_buckets = new concurrent_stack<cached_block>[(num_nodes + 1) * num_large];
+      num_worker_caches = std::max(1, num_workers());
+      worker_caches = new worker_cache[num_worker_caches];
+      if (num_buckets > 4096)
+	throw std::invalid_argument("for pool_allocator, at most 4096 sizes");
+
+      class_bucket.resize(size_class(max_size) + 1);
+      for (size_t c = 0, b = 0; c < class_bucket.size(); c++) {
+	size_t lower = (c == 0) ? 1 : class_size(c - 1) + 1;
+	while (sizes[b] < lower) b++;
+	class_bucket[c] = b;
+      }
 
       small_allocators = (struct block_allocator*)
 	malloc(num_buckets * sizeof(struct block_allocator));
@@ -118,35 +451,109 @@ namespace pbbs {
       }
     }
 
+    // Bounds the bytes kept in the large block cache.
+    void set_large_cache_limit(size_t bytes) {
+      large_cache_limit = bytes;
+      trim_to_limit();
+    }
+
+    // Cached large blocks older than this many seconds are unmapped
+    // (0 keeps them until clear, the default).
+    void set_large_cache_decay(double seconds) {
+      large_cache_decay = seconds;
+    }
+
+    // Large blocks of at least this many bytes are interleaved over the
+    // NUMA nodes, e.g. for large arrays shared by all workers.  Should
+    // be set before they are allocated.
+    void set_interleave_threshold(size_t bytes) {
+      interleave_threshold = bytes;
+    }
+
+    // Unmaps cached large blocks freed more than max_age seconds ago.
+    // Blocks can be allocated and freed concurrently.
+    void trim(double max_age = 0.0) {
+      double cutoff = now() - max_age;
+      large_trimmed += clear_worker_caches(cutoff);
+      for (int p = 0; p <= num_nodes; p++)
+	for (size_t i = num_small; i < num_buckets; i++) {
+	  std::vector<cached_block> keep;
+	  maybe<cached_block> r;
+	  while ((r = large_bucket(p, i).pop())) {
+	    if ((*r).freed > cutoff) keep.push_back(*r);
+	    else {
+	      large_cached -= mapped(i);
+	      large_trimmed += mapped(i);
+	      unmap_large((*r).ptr, sizes[i]);
+	    }
+	  }
+	  // oldest first, so the stack stays ordered by age
+	  for (size_t j = keep.size(); j > 0; j--)
+	    large_bucket(p, i).push(keep[j-1]);
+	}
+    }
+
+    // Unmaps cached large blocks, largest first, until within the limit.
+    void trim_to_limit() {
+      if ((size_t) large_cached > large_cache_limit)
+	large_trimmed += clear_worker_caches();
+      for (size_t i = num_buckets; i > num_small; i--)
+	for (int p = 0; p <= num_nodes; p++)
+	  while ((size_t) large_cached > large_cache_limit) {
+	    maybe<cached_block> r = large_bucket(p, i-1).pop();
+	    if (!r) break;
+	    large_cached -= mapped(i-1);
+	    large_trimmed += mapped(i-1);
+	    unmap_large((*r).ptr, sizes[i-1]);
+	  }
+    }
+
+    struct stats {
+      size_t small_allocated;   // bytes in small blocks
+      size_t small_used;        // ... of which are in use
+      size_t large_allocated;   // bytes mapped for large blocks
+      size_t large_cached;      // ... of which are in the cache
+      size_t large_trimmed;     // bytes unmapped by trimming so far
+      size_t large_cache_limit;
+    };
+
+    stats get_stats() {
+      stats r = {0, 0, (size_t) (long) large_allocated,
+		 (size_t) (long) large_cached, (size_t) (long) large_trimmed,
+		 large_cache_limit};
+      for (size_t i = 0; i < num_small; i++) {
+	r.small_allocated += small_allocators[i].num_allocated_blocks() * sizes[i];
+	r.small_used += small_allocators[i].num_used_blocks() * sizes[i];
+      }
+      return r;
+    }
+
     void* allocate(size_t n) {
+      race_ignore ignore;
       if (n > max_small) return allocate_large(n);
-      size_t bucket = 0;
-      while (n > sizes[bucket]) bucket++;
-      return small_allocators[bucket].alloc();
+      return small_allocators[find_bucket(n)].alloc();
     }
 
     void deallocate(void* ptr, size_t n) {
+      race_forget(ptr, n);
+      race_ignore ignore;
       if (n > max_small) deallocate_large(ptr, n);
-      else {
-	size_t bucket = 0;
-	while (n > sizes[bucket]) bucket++;
-	small_allocators[bucket].free(ptr);
-      }
+      else small_allocators[find_bucket(n)].free(ptr);
     }
 
-    // allocate, touch, and free to make sure space for small blocks is paged in
+    // map, touch, and free to make sure space for small blocks is paged in
+    // each block is touched and freed by the same worker, so it goes to
+    // the caches of that worker and its node.  The blocks are mapped
+    // rather than allocated, since allocating would reuse the ones freed.
     void reserve(size_t bytes) {
       size_t bc = bytes/small_alloc_block_size;
-      std::vector<void*> h(bc);
-      parallel_for(0, bc, [&] (size_t i) {
-	  h[i] = allocate(small_alloc_block_size);
+      size_t stride = large_pages::touch_stride(small_alloc_block_size);
+      parallel_for(0, bc, [&] (size_t) {
+	  char* a = (char*) map_large(small_alloc_block_size);
+	  for (size_t j=0; j < small_alloc_block_size; j += stride)
+	    a[j] = 0;
+	  deallocate(a, small_alloc_block_size);
 	}, 1);
-      parallel_for(0, bc, [&] (size_t i) {
-	  for (size_t j=0; j < small_alloc_block_size; j += (1 << 12))
-	    ((char*) h[i])[j] = 0;
-	}, 1);
-      for (size_t i=0; i < bc; i++)
-      	deallocate(h[i], small_alloc_block_size);
     }
 
     void print_stats() {
@@ -161,39 +568,168 @@ namespace pbbs {
 	cout << "size = " << bucket_size << ", allocated = " << allocated
 	     << ", used = " << used << endl;
       }
-      cout << "Large allocated = " << large_allocated << endl;
+      cout << "Large allocated = " << large_allocated
+	   << ", cached = " << large_cached << endl;
       cout << "Total bytes allocated = " << total_a + large_allocated << endl;
       cout << "Total bytes used = " << total_u << endl;
     }
 
     void clear() {
-      for (size_t i = num_small; i < num_buckets; i++) {
-	maybe<void*> r = large_buckets[i-num_small].pop();
-	while (r) {
-	  large_allocated -= sizes[i];
-	  free(*r);
-	  r = large_buckets[i-num_small].pop();
+      clear_worker_caches();
+      for (int p = 0; p <= num_nodes; p++)
+	for (size_t i = num_small; i < num_buckets; i++) {
+	  maybe<cached_block> r = large_bucket(p, i).pop();
+	  while (r) {
+	    large_cached -= mapped(i);
+	    unmap_large((*r).ptr, sizes[i]);
+	    r = large_bucket(p, i).pop();
+	  }
 	}
-      }
     }
   };
 
   // ****************************************
-  //    default_allocator (uses powers of two as pool sizes)
+  //    default_allocator (uses default_sizes as pool sizes)
   // ****************************************
 
   // these are bucket sizes used by the default allocator.
+  // Powers of two for small blocks, and four sizes per power of two
+  // for large blocks, so at most a fifth of a large block is unused.
+  // There are fewer small sizes since each keeps lists for every worker.
   std::vector<size_t> default_sizes() {
     size_t log_min_size = 4;
+    size_t log_large_size = 20; // pool_allocator's large_threshold
     size_t log_max_size = pbbs::log2_up(getMemorySize()/64);
 
     std::vector<size_t> sizes;
-    for (size_t i = log_min_size; i <= log_max_size; i++)
-      sizes.push_back(1 << i);
+    for (size_t i = log_min_size; i < log_large_size; i++)
+      sizes.push_back(((size_t) 1) << i);
+    sizes.push_back(((size_t) 1) << log_large_size);
+    for (size_t i = log_large_size; i < log_max_size; i++)
+      for (size_t j = 5; j <= 8; j++)
+	sizes.push_back((((size_t) 1) << (i - 2)) * j);
     return sizes;
   }
 
-  pool_allocator default_allocator(default_sizes());
+  // created when first used, like the type_allocator pools, and never
+  // destructed, so they can free to it at exit
+  inline pool_allocator& default_allocator() {
+    static pool_allocator* a = new pool_allocator(default_sizes());
+    return *a;
+  }
+
+  // ****************************************
+  //    allocation accounting (compile with -DALLOC_STATS)
+  // ****************************************
+
+  // Counts the bytes allocated by my_alloc and pbbs::allocator (and so
+  // by sequences) against tags, e.g.
+  //    alloc_tag tag("sample_sort");
+  // tags the allocations made by this thread until the end of the scope.
+  // Tags nest, the innermost applies, and allocations without one are
+  // "untagged".  Work forked to other workers is not tagged by the
+  // forking thread, and a worker that steals work while waiting at a
+  // fork tags it with its own tag, so nested tags are approximate.
+  // For each tag it keeps the bytes allocated now, their peak, and the
+  // bytes allocated when the total peaked.  alloc_stats_report prints
+  // these and the blocks still allocated, and is called at exit.
+  // It takes a lock for every allocation, so is only for debugging.
+  // Without ALLOC_STATS alloc_tag does nothing.
+#if defined(ALLOC_STATS)
+  struct alloc_stats {
+    struct tag_info {
+      long current = 0;
+      long peak = 0;
+      long at_peak = 0;   // when the total peaked
+      size_t count = 0;   // number of allocations
+    };
+    struct block_info {
+      size_t n;
+      const char* tag;
+    };
+
+    std::mutex m;
+    std::map<std::string, tag_info> tags;
+    std::unordered_map<void*, block_info> blocks;
+    long current = 0;
+    long peak = 0;
+
+    void add(void* p, size_t n, const char* tag) {
+      std::lock_guard<std::mutex> lock(m);
+      blocks[p] = block_info{n, tag};
+      tag_info& t = tags[tag];
+      t.count++;
+      t.current += n;
+      t.peak = std::max(t.peak, t.current);
+      current += n;
+      if (current > peak) {
+	peak = current;
+	for (auto& x : tags) x.second.at_peak = x.second.current;
+      }
+    }
+
+    void remove(void* p) {
+      std::lock_guard<std::mutex> lock(m);
+      auto it = blocks.find(p);
+      if (it == blocks.end()) return; // allocated before counting started
+      tags[it->second.tag].current -= it->second.n;
+      current -= it->second.n;
+      blocks.erase(it);
+    }
+
+    void report(FILE* f, size_t max_blocks = 20) {
+      std::lock_guard<std::mutex> lock(m);
+      fprintf(f, "allocation stats: peak = %ld, current = %ld bytes\n",
+	      peak, current);
+      fprintf(f, "%-28s %14s %14s %14s %10s\n",
+	      "tag", "peak", "at total peak", "current", "allocs");
+      for (auto& x : tags)
+	fprintf(f, "%-28s %14ld %14ld %14ld %10lu\n", x.first.c_str(),
+		x.second.peak, x.second.at_peak, x.second.current,
+		(unsigned long) x.second.count);
+      if (blocks.size() > 0) {
+	fprintf(f, "%lu blocks still allocated:\n", (unsigned long) blocks.size());
+	size_t i = 0;
+	for (auto& b : blocks) {
+	  if (i++ == max_blocks) { fprintf(f, "  ...\n"); break; }
+	  fprintf(f, "  %p: %lu bytes, %s\n", b.first,
+		  (unsigned long) b.second.n, b.second.tag);
+	}
+      }
+    }
+  };
+
+  // never destructed, so it can be used at exit
+  inline alloc_stats& the_alloc_stats() {
+    static alloc_stats* s = new alloc_stats;
+    return *s;
+  }
+
+  inline thread_local const char* current_alloc_tag = "untagged";
+
+  struct alloc_tag {
+    const char* prev;
+    alloc_tag(const char* name) : prev(current_alloc_tag) {
+      current_alloc_tag = name;}
+    ~alloc_tag() {current_alloc_tag = prev;}
+  };
+
+  inline void track_alloc(void* p, size_t n) {
+    the_alloc_stats().add(p, n, current_alloc_tag);}
+  inline void track_free(void* p) {the_alloc_stats().remove(p);}
+
+  inline void alloc_stats_report() {the_alloc_stats().report(stderr);}
+
+  struct __alloc_stats_atexit {
+    __alloc_stats_atexit() {std::atexit(alloc_stats_report);}
+  };
+  static __alloc_stats_atexit __alloc_stats_atexit_var;
+#else
+  struct alloc_tag { alloc_tag(const char*) {} };
+  inline void track_alloc(void*, size_t) {}
+  inline void track_free(void*) {}
+  inline void alloc_stats_report() {}
+#endif
 
   // ****************************************
   // Following Matches the c++ Allocator specification (minimally)
@@ -206,10 +742,13 @@ namespace pbbs {
   struct allocator {
     using value_type = T;
     T* allocate(size_t n) {
-      return (T*) default_allocator.allocate(n * sizeof(T));
+      T* r = (T*) default_allocator().allocate(n * sizeof(T));
+      track_alloc(r, n * sizeof(T));
+      return r;
     }
     void deallocate(T* ptr, size_t n) {
-      default_allocator.deallocate((void*) ptr, n * sizeof(T));
+      track_free(ptr);
+      default_allocator().deallocate((void*) ptr, n * sizeof(T));
     }
 
     allocator() = default;
@@ -227,36 +766,39 @@ namespace pbbs {
   //   long* foo = long_allocator::alloc();
   //   *foo = (long) 23;
   //   long_allocator::free(foo);
-  // Uses block allocator, and is headerless  
+  // Uses block allocator, and is headerless
+  // The pool for a type is created, thread safely, when first used,
+  // so it can be used during static initialization (e.g. from another
+  // translation unit), and its local lists are sized for the live
+  // scheduler.
   // ****************************************
 
   template <typename T>
   class type_allocator {
   public:
     static constexpr size_t default_alloc_size = 0;
-    static block_allocator allocator;
-    static const bool initialized{true};
-    static T* alloc() { return (T*) allocator.alloc();}
-    static void free(T* ptr) {allocator.free((void*) ptr);}
+    static block_allocator& allocator() {
+      static block_allocator a(sizeof(T));
+      return a;
+    }
+    static T* alloc() { return (T*) allocator().alloc();}
+    static void free(T* ptr) {allocator().free((void*) ptr);}
 
     // for backward compatibility
     //static void init(size_t _alloc_size = 0, size_t _list_size=0) {};
     static void init(size_t, size_t) {};
     static void init() {};
     static void reserve(size_t n = default_alloc_size) {
-      allocator.reserve(n);
+      allocator().reserve(n);
     }
-    static void finish() {allocator.clear();
+    static void finish() {allocator().clear();
     }
-    static size_t block_size () {return allocator.block_size();}
-    static size_t num_allocated_blocks() {return allocator.num_allocated_blocks();}
-    static size_t num_used_blocks() {return allocator.num_used_blocks();}
+    static size_t block_size () {return allocator().block_size();}
+    static size_t num_allocated_blocks() {return allocator().num_allocated_blocks();}
+    static size_t num_used_blocks() {return allocator().num_used_blocks();}
     static size_t num_used_bytes() {return num_used_blocks() * block_size();}
-    static void print_stats() {allocator.print_stats();}
+    static void print_stats() {allocator().print_stats();}
   };
-
-  template<typename T>
-  block_allocator type_allocator<T>::allocator = block_allocator(sizeof(T));
   
   // ****************************************
   //    my_alloc and my_free (add size tags)
@@ -277,8 +819,8 @@ namespace pbbs {
 
   __mallopt __mallopt_var;
   
-  inline void* my_alloc(size_t i) {return malloc(i);}
-  inline void my_free(void* p) {free(p);}
+  inline void* my_alloc_internal(size_t i) {return malloc(i);}
+  inline void my_free_internal(void* p) {free(p);}
   void allocator_clear() {}
   void allocator_reserve(size_t bytes) {}
 
@@ -292,35 +834,68 @@ namespace pbbs {
   }
 
   // allocates and tags with a header (8, 16 or 64 bytes) that contains the size
-  void* my_alloc(size_t n) {
+  void* my_alloc_internal(size_t n) {
     size_t hsize = header_size(n);
     void* ptr;
-    ptr = default_allocator.allocate(n + hsize);
+    ptr = default_allocator().allocate(n + hsize);
     void* r = (void*) (((char*) ptr) + hsize);
     *(((size_t*) r)-size_offset) = n; // puts size in header
     return r;
   }
 
   // reads the size, offsets the header and frees
-  void my_free(void *ptr) {
+  void my_free_internal(void *ptr) {
     size_t n = *(((size_t*) ptr)-size_offset);
     size_t hsize = header_size(n);
     if (hsize > (1ul << 48)) {
       cout << "corrupted header in my_free" << endl;
       throw std::bad_alloc(); 
     }
-    default_allocator.deallocate((void*) (((char*) ptr) - hsize), n + hsize);
+    default_allocator().deallocate((void*) (((char*) ptr) - hsize), n + hsize);
   }
 
   void allocator_clear() {
-    default_allocator.clear();
+    default_allocator().clear();
   }
 
   void allocator_reserve(size_t bytes) {
-    default_allocator.reserve(bytes);
+    default_allocator().reserve(bytes);
   }
 #endif
 
+  void* my_alloc(size_t n) {
+    void* r = my_alloc_internal(n);
+    track_alloc(r, n);
+    return r;
+  }
+
+  void my_free(void* p) {
+    track_free(p);
+    my_free_internal(p);
+  }
+
+  // For monitoring and bounding the memory kept by the default allocator
+  // (see pool_allocator).
+  pool_allocator::stats allocator_stats() {
+    return default_allocator().get_stats();
+  }
+
+  void allocator_trim(double max_age = 0.0) {
+    default_allocator().trim(max_age);
+  }
+
+  void allocator_set_large_cache_limit(size_t bytes) {
+    default_allocator().set_large_cache_limit(bytes);
+  }
+
+  void allocator_set_large_cache_decay(double seconds) {
+    default_allocator().set_large_cache_decay(seconds);
+  }
+
+  void allocator_set_interleave_threshold(size_t bytes) {
+    default_allocator().set_interleave_threshold(bytes);
+  }
+
   // ****************************************
   //    common across allocators (key routines used by sequences)
   // ****************************************
@@ -0,0 +1,194 @@
+// An arena for the temporaries of a parallel algorithm, e.g.
+//    arena_scope scope;
+//    sequence<T, arena_allocator<T>> Tmp = ...;
+// Allocation takes a bump pointer in chunks kept by the running worker,
+// and the memory is released all at once when the last live
+// arena_scope (over all workers) ends, by returning the chunks to the
+// default allocator.  It caches them, so the next scope usually gets
+// them back without faulting in their pages, and they are counted,
+// trimmed and cleared with its other large blocks.
+// Freeing the most recent allocation of a worker on the same worker
+// also gives back its space.  Since a worker only steals work when
+// waiting at a fork, and finishes it before continuing, temporaries
+// that are allocated and freed in the same task are freed in this
+// order, so loops over phases do not grow the arena.  Other frees do
+// nothing until the scopes end.
+// arena_allocator must only be used while an arena_scope is live, and
+// what it allocates must not be used after the scope ends.  Forked work
+// can allocate in the scope of the thread that forked it.
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include "utilities.h"
+#include "seq.h"
+
+namespace pbbs {
+
+  struct arena {
+  private:
+    static constexpr size_t min_chunk_size = ((size_t) 1) << 20;
+    static constexpr size_t align = 64;
+
+    struct chunk {
+      char* start;
+      size_t size;
+    };
+
+    struct alignas(128) worker_state {
+      std::vector<chunk> chunks;
+      size_t current = 0;  // chunk being bumped
+      size_t offset = 0;   // bump pointer within it
+      size_t generation = 0;
+    };
+
+    // number of live scopes in the low 31 bits, a flag that is set while
+    // the last scope to end returns the chunks (scopes cannot start
+    // then), and the generation, which is incremented when it is done,
+    // above them
+    std::atomic<size_t> scopes{0};
+    static constexpr size_t closing = ((size_t) 1) << 31;
+    static constexpr size_t count_mask = closing - 1;
+    std::vector<worker_state> workers;
+
+    static size_t round_up(size_t n) { return (n + align - 1) & ~(align - 1); }
+
+    // resets the worker's chunks if their allocations are from a scope
+    // that has ended
+    worker_state& get_state() {
+      worker_state& w = workers[worker_id()];
+      size_t generation = scopes.load() >> 32;
+      if (w.generation != generation) {
+	w.current = w.offset = 0;
+	w.generation = generation;
+      }
+      return w;
+    }
+
+  public:
+    arena() : workers(num_workers()) {
+      add_worker_resize_hook([this] (int n) {
+	  clear();
+	  workers = std::vector<worker_state>(n);});
+    }
+
+    ~arena() { clear(); }
+
+    void enter() {
+      while (true) {
+	size_t s = scopes.load();
+	if (s & closing) std::this_thread::yield();
+	else if (scopes.compare_exchange_weak(s, s + 1)) return;
+      }
+    }
+
+    void exit() {
+      size_t s = scopes.load();
+      size_t ns;
+      do ns = ((s & count_mask) == 1) ? (s - 1) | closing : s - 1;
+      while (!scopes.compare_exchange_weak(s, ns));
+      if (ns & closing) {
+	release();
+	scopes.store(((ns >> 32) + 1) << 32);
+      }
+    }
+
+    bool active() { return (scopes.load() & count_mask) > 0; }
+
+    void* allocate(size_t n) {
+      race_ignore ignore;
+      if (!active())
+	throw std::logic_error("arena_allocator used outside of an arena_scope");
+      worker_state& w = get_state();
+      n = round_up(n);
+      while (w.current < w.chunks.size() &&
+	     w.offset + n > w.chunks[w.current].size) {
+	w.current++;
+	w.offset = 0;
+      }
+      if (w.current == w.chunks.size()) {
+	size_t size = std::max(n, min_chunk_size);
+	w.chunks.push_back(chunk{(char*) default_allocator().allocate(size), size});
+      }
+      void* r = w.chunks[w.current].start + w.offset;
+      w.offset += n;
+      race_forget(r, n);
+      return r;
+    }
+
+    void deallocate(void* ptr, size_t n) {
+      race_ignore ignore;
+      worker_state& w = workers[worker_id()];
+      if (w.generation != (scopes.load() >> 32) || w.current == w.chunks.size())
+	return;
+      n = round_up(n);
+      if (w.offset >= n && (char*) ptr + n == w.chunks[w.current].start + w.offset)
+	w.offset -= n;
+    }
+
+    // bytes held in chunks
+    size_t allocated() {
+      size_t total = 0;
+      for (auto& w : workers)
+	for (auto& c : w.chunks) total += c.size;
+      return total;
+    }
+
+    // returns all chunks to the default allocator, only when no scope is live
+    void clear() {
+      if (!active()) release();
+    }
+
+  private:
+    void release() {
+      for (auto& w : workers) {
+	for (auto& c : w.chunks) default_allocator().deallocate(c.start, c.size);
+	w.chunks.clear();
+	w.current = w.offset = 0;
+      }
+    }
+  };
+
+  // created on first use, so the scheduler exists
+  inline arena& default_arena() {
+    static arena* a = new arena;
+    return *a;
+  }
+
+  struct arena_scope {
+    arena_scope() { default_arena().enter(); }
+    ~arena_scope() { default_arena().exit(); }
+    arena_scope(const arena_scope&) = delete;
+    arena_scope& operator=(const arena_scope&) = delete;
+  };
+
+  // Matches the c++ Allocator specification, as pbbs::allocator does
+  template <typename T>
+  struct arena_allocator {
+    using value_type = T;
+    T* allocate(size_t n) {
+      return (T*) default_arena().allocate(n * sizeof(T));
+    }
+    void deallocate(T* ptr, size_t n) {
+      default_arena().deallocate((void*) ptr, n * sizeof(T));
+    }
+
+    arena_allocator() = default;
+    template <class U> constexpr arena_allocator(const arena_allocator<U>&) {}
+  };
+
+  template <class T, class U>
+  bool operator==(const arena_allocator<T>&, const arena_allocator<U>&) { return true; }
+  template <class T, class U>
+  bool operator!=(const arena_allocator<T>&, const arena_allocator<U>&) { return false; }
+
+  // sequences whose elements are allocated in the arena
+  template <typename T>
+  using arena_sequence = sequence<T, arena_allocator<T>>;
+
+  inline void arena_clear() { default_arena().clear(); }
+}
@@ -24,6 +24,12 @@
 // Keeps a local pool per processor
 // Grabs list_size elements from a global pool if empty, and
 // Returns list_size elements to the global pool when local pool=2*list_size
+// The global pool is a set of shards, each a stack of lists linked
+// through their first block under a spin lock, so it allocates no
+// memory and workers using different shards do not contend.  A worker
+// pushes to its own shard, and pops from its own shard first, then from
+// the other shards of its NUMA node (see worker_node), then of the
+// other nodes.
 // Keeps track of number of allocated elements.
 // Probably more efficient than a general purpose allocator
 
@@ -33,6 +39,10 @@
 #include <stdlib.h>
 #include <math.h>
 #include <atomic>
+#include <mutex>
+#include <thread>
+#include <algorithm>
+#include <vector>
 #include <assert.h>
 #include "concurrent_stack.h"
 #include "utilities.h"
@@ -46,10 +56,44 @@ private:
 
   struct block {
     block* next;
+    block* next_list; // only used by the first block of a list in a shard
   };
 
   using block_p = block*;
 
+  struct alignas(64) shard {
+    std::atomic<bool> locked{false};
+    std::atomic<size_t> count{0};
+    block_p head = NULL;
+
+    void lock() {
+      for (int i = 0; locked.exchange(true, std::memory_order_acquire); i++)
+	while (locked.load(std::memory_order_relaxed))
+	  if (++i > 64) std::this_thread::yield();
+    }
+    void unlock() { locked.store(false, std::memory_order_release); }
+
+    void push(block_p list) {
+      lock();
+      list->next_list = head;
+      head = list;
+      count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+      unlock();
+    }
+
+    block_p pop() {
+      if (count.load(std::memory_order_relaxed) == 0) return NULL;
+      lock();
+      block_p r = head;
+      if (r != NULL) {
+	head = r->next_list;
+	count.store(count.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+      }
+      unlock();
+      return r;
+    }
+  };
+
   struct alignas(64) thread_list {
     size_t sz;
     block_p head;
@@ -62,7 +106,11 @@ private:
   block_p initialize_list(block_p);
   block_p get_list();
   concurrent_stack<char*> pool_roots;
-  concurrent_stack<block_p> global_stack;
+  shard* shards = NULL;    // num_nodes * shards_per_node of them
+  int num_nodes = 1;
+  int shards_per_node = 1;
+  shard& own_shard();
+  void push_global(block_p list);
   thread_list* local_lists;
 
   size_t list_length;
@@ -71,9 +119,30 @@ private:
   //std::atomic<size_t> blocks_allocated;
   size_t blocks_allocated;
   char* allocate_blocks(size_t num_blocks);
+  void push_local(int id, block_p new_node);
+  void resize_local_lists(int old_count, int new_count);
+
+  // all constructed block_allocators, so their local lists can be
+  // resized when the number of workers changes
+  static std::vector<block_allocator*>& all_allocators() {
+    static auto all = new std::vector<block_allocator*>();
+    return *all;
+  }
+  static std::mutex& all_allocators_mutex() {
+    static std::mutex m;
+    return m;
+  }
+
+  // the number of local lists, from num_workers when first used (which
+  // can be before the scheduler starts), and then by the resize hook
+  static int& thread_count_() {
+    static int n = num_workers();
+    return n;
+  }
 
 public:
-  static int thread_count;
+  static int thread_count() {return thread_count_();}
+  static void set_thread_count(int n);
   void* alloc();
   void free(void*);
   void reserve(size_t n);
@@ -91,7 +160,36 @@ public:
   block_allocator() {};
 };
 
-int block_allocator::thread_count = num_workers();
+// Resizes the local lists of every block_allocator to n workers.
+// Not safe to run concurrently with alloc or free.
+void block_allocator::set_thread_count(int n) {
+  std::lock_guard<std::mutex> lock(all_allocators_mutex());
+  for (block_allocator* a : all_allocators())
+    a->resize_local_lists(thread_count_(), n);
+  thread_count_() = n;
+}
+
+struct __block_allocator_resize {
+  __block_allocator_resize() {
+    add_worker_resize_hook(block_allocator::set_thread_count);}
+};
+static __block_allocator_resize __block_allocator_resize_var;
+
+// Blocks held by removed workers are moved to the list of worker 0
+void block_allocator::resize_local_lists(int old_count, int new_count) {
+  thread_list* old_lists = local_lists;
+  local_lists = new thread_list[new_count];
+  for (int i = 0; i < std::min(old_count, new_count); i++)
+    local_lists[i] = old_lists[i];
+  for (int i = new_count; i < old_count; i++) 
+    while (old_lists[i].sz > 0) {
+      block_p p = old_lists[i].head;
+      old_lists[i].head = p->next;
+      old_lists[i].sz--;
+      push_local(0, p);
+    }
+  delete[] old_lists;
+}
 
 // Allocate a new list of list_length elements
 
@@ -106,8 +204,10 @@ auto block_allocator::initialize_list(block_p start) -> block_p {
 }
 
 size_t block_allocator::num_used_blocks() {
-  size_t free_blocks = global_stack.size()*list_length;
-  for (int i = 0; i < thread_count; ++i) 
+  size_t free_blocks = 0;
+  for (int i = 0; i < num_nodes * shards_per_node; i++)
+    free_blocks += shards[i].count * list_length;
+  for (int i = 0; i < thread_count(); ++i) 
     free_blocks += local_lists[i].sz;
   return blocks_allocated - free_blocks;
 }
@@ -115,7 +215,7 @@ size_t block_allocator::num_used_blocks() {
 auto block_allocator::allocate_blocks(size_t num_blocks) -> char* {
   //char* start = (char*) aligned_alloc(pad_size,
   //num_blocks * block_size_+ pad_size);
-  char* start = (char*) pbbs::my_alloc(num_blocks * block_size_);
+  char* start = (char*) pbbs::my_alloc_internal(num_blocks * block_size_);
   if (start == NULL) {
     fprintf(stderr, "Cannot allocate space in block_allocator");
     exit(1); }
@@ -130,22 +230,38 @@ auto block_allocator::allocate_blocks(size_t num_blocks) -> char* {
   return start;
 }
 
-// Either grab a list from the global pool, or if there is none
-// then allocate a new list
+inline auto block_allocator::own_shard() -> shard& {
+  int node = worker_node() % num_nodes;
+  return shards[node * shards_per_node + worker_id() % shards_per_node];
+}
+
+inline void block_allocator::push_global(block_p list) {
+  own_shard().push(list);
+}
+
+// Either grab a list from the global pool, own shard and node first,
+// or if there is none then allocate a new list
 auto block_allocator::get_list() -> block_p {
-  maybe<block_p> rem = global_stack.pop();
-  if (rem) return *rem;
+  int node = worker_node() % num_nodes;
+  int own = worker_id() % shards_per_node;
+  for (int i = 0; i < num_nodes; i++) {
+    shard* s = shards + ((node + i) % num_nodes) * shards_per_node;
+    for (int j = 0; j < shards_per_node; j++) {
+      block_p r = s[(own + j) % shards_per_node].pop();
+      if (r != NULL) return r;
+    }
+  }
   block_p start = (block_p) allocate_blocks(list_length);
   return initialize_list(start);
 }
 
 // Allocate n elements across however many lists are needed (rounded up)
 void block_allocator::reserve(size_t n) {
-  size_t num_lists = thread_count + ceil(n / (double)list_length);
+  size_t num_lists = thread_count() + ceil(n / (double)list_length);
   char* start = allocate_blocks(list_length*num_lists);
   mcsl_for(0, num_lists, [&] (size_t i) {
       block_p offset = (block_p) (start + i * list_length * block_size_);
-      global_stack.push(initialize_list(offset));
+      push_global(initialize_list(offset));
     });
 }
 
@@ -163,18 +279,26 @@ block_allocator::block_allocator(size_t block_size,
 				 size_t list_length_,
 				 size_t max_blocks_) {
   blocks_allocated = 0;
-  block_size_ = block_size;
+  block_size_ = std::max(block_size, sizeof(block));
+  num_nodes = std::max(1, num_worker_nodes());
+  // about one shard per four workers
+  shards_per_node = std::max(1, (thread_count() / num_nodes + 3) / 4);
+  shards = new shard[num_nodes * shards_per_node];
   if (list_length_ == 0)
-    list_length = default_list_bytes / block_size;
-  else list_length = list_length_ / block_size;
+    list_length = default_list_bytes / block_size_;
+  else list_length = list_length_ / block_size_;
   if  (max_blocks_ == 0)
-    max_blocks = (3*getMemorySize()/block_size)/4;
+    max_blocks = (3*getMemorySize()/block_size_)/4;
   else max_blocks = max_blocks_;
 
-  reserve(reserved_blocks);
+  // lists are otherwise allocated when first needed, so a pool of the
+  // default allocator does not allocate from it while it is constructed
+  if (reserved_blocks > 0) reserve(reserved_blocks);
 
   // all local lists start out empty
-  local_lists = new thread_list[thread_count];
+  std::lock_guard<std::mutex> lock(all_allocators_mutex());
+  local_lists = new thread_list[thread_count()];
+  all_allocators().push_back(this);
   initialized = true;
 }
 
@@ -184,31 +308,39 @@ void block_allocator::clear() {
 	 << " : allocated blocks remain" << endl;
   else {
     // clear lists
-    for (int i = 0; i < thread_count; ++i) 
+    for (int i = 0; i < thread_count(); ++i) 
       local_lists[i].sz = 0;
   
     // throw away all allocated memory
     maybe<char*> x;
-    while ((x = pool_roots.pop())) pbbs::my_free(*x); //std::free(*x);
+    while ((x = pool_roots.pop())) pbbs::my_free_internal(*x); //std::free(*x);
     pool_roots.clear();
-    global_stack.clear();
+    for (int i = 0; i < num_nodes * shards_per_node; i++) {
+      shards[i].head = NULL;
+      shards[i].count = 0;
+    }
     blocks_allocated = 0;
   }
 }
 
 block_allocator::~block_allocator() {
+  {
+    std::lock_guard<std::mutex> lock(all_allocators_mutex());
+    auto& all = all_allocators();
+    all.erase(std::remove(all.begin(), all.end(), this), all.end());
+  }
   clear();
   delete[] local_lists;
+  delete[] shards;
 }
 
-void block_allocator::free(void* ptr) {
-  block_p new_node = (block_p) ptr;
-  int id = worker_id();
-
+// Pushes onto the local list of worker id, returning list_length
+// blocks to the global pool when it reaches 2*list_length.
+inline void block_allocator::push_local(int id, block_p new_node) {
   if (local_lists[id].sz == list_length+1) {
     local_lists[id].mid = local_lists[id].head;
   } else if (local_lists[id].sz == 2*list_length) {
-    global_stack.push(local_lists[id].mid->next);
+    push_global(local_lists[id].mid->next);
     local_lists[id].mid->next = NULL;
     local_lists[id].sz = list_length;
   }
@@ -217,7 +349,14 @@ void block_allocator::free(void* ptr) {
   local_lists[id].sz++;
 }
 
+void block_allocator::free(void* ptr) {
+  race_forget(ptr, block_size());
+  race_ignore ignore;
+  push_local(worker_id(), (block_p) ptr);
+}
+
 inline void* block_allocator::alloc() {
+  race_ignore ignore;
   int id = worker_id();
 
   if (local_lists[id].sz == 0)  {
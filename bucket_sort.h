@@ -106,7 +106,7 @@ namespace pbbs {
   	  bucket_sort_r(out.slice(start,end), in.slice(start,end), f,
   			stable, !inplace);
   	};
-	parallel_for (0, num_buckets, loop, 4);
+	par_do_n(num_buckets, loop);
       }
     }
   }
@@ -27,6 +27,7 @@
 #include "sequence_ops.h"
 #include "transpose.h"
 #include "integer_sort.h"
+#include "arena_allocator.h"
 
 // Supports functions that take a seq of key-value pairs, collects all the
 // keys with the same value, and sums them up with a binary function (monoid)
@@ -331,13 +332,16 @@ namespace pbbs {
     bits = std::max<size_t>(bits, 4);
     size_t num_buckets = (1<<bits);
 
+    // temporaries are allocated in the arena
+    arena_scope scope;
+
     // Returns a map (hash) from key to bucket.
     // Keys with many elements (big) have their own bucket while
     // others share a bucket.
     // Keys that share low 4 bits get same bucket unless big.
     // This is to avoid false sharing.
-    sequence<T> B = sequence<T>::no_init(n);
-    sequence<T> Tmp = sequence<T>::no_init(n);
+    arena_sequence<T> B = arena_sequence<T>::no_init(n);
+    arena_sequence<T> Tmp = arena_sequence<T>::no_init(n);
 
     // first buckets based on hash using a counting sort
     get_bucket<T,HashEq> gb(A, hasheq, bits);
@@ -354,14 +358,14 @@ namespace pbbs {
       factor += (17 - log2_up(bucket_size))*.15;
     size_t table_size = (factor * bucket_size);
     size_t total_table_size = table_size * num_tables;
-    sequence<T> table = sequence<T>::no_init(total_table_size);
-    sequence<size_t> sizes(num_tables + 1);
+    arena_sequence<T> table = arena_sequence<T>::no_init(total_table_size);
+    arena_sequence<size_t> sizes(num_tables + 1);
 
     // now in parallel process each bucket sequentially
     parallel_for(0, num_tables, [&] (size_t i) {
       T* my_table = table.begin() + i * table_size;
 
-      sequence<bool> flags(table_size, false);
+      arena_sequence<bool> flags(table_size, false);
       // clear tables
       //for (size_t i = 0; i < table_size; i++)
       // assign_uninitialized(my_table[i], T(empty, identity));
@@ -0,0 +1,231 @@
+// This code is part of the Problem Based Benchmark Suite (PBBS)
+// Copyright (c) 2011-2019 Guy Blelloch and the PBBS team
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the
+// "Software"), to deal in the Software without restriction, including
+// without limitation the rights (to use, copy, modify, merge, publish,
+// distribute, sublicense, and/or sell copies of the Software, and to
+// permit persons to whom the Software is furnished to do so, subject to
+// the following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+// OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+// LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+// OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+// WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#pragma once
+
+#include <memory>
+#include <optional>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+#include "utilities.h"
+
+// Asynchronous tasks, for work that does not nest as fork-join, e.g.
+//   auto f = pbbs::spawn([&] () {return read_input(name);});
+//   ...  // runs in parallel with the spawned function
+//   auto in = f.get();
+// With HOMEGROWN the spawned function runs on the same workers as
+// par_do and parallel_for, taken from a queue by idle workers.
+// Waiting on a future (wait or get) whose function has not started
+// runs it on the waiting thread.  If it has started elsewhere the
+// thread helps by stealing the jobs the function forked (and their
+// forks), and yields when there are none.  It runs no other jobs,
+// since these could wait on a frame under it (e.g. on the future of a
+// function that is waiting).
+// With the other schedulers spawn runs the function immediately.
+// A future waits for its function to finish when destroyed.
+namespace pbbs {
+
+  template <class T>
+  using future_value_t =
+    typename std::conditional<std::is_void<T>::value, empty, T>::type;
+
+  template <class T>
+  struct future_state {
+    std::optional<future_value_t<T>> value;
+    virtual bool finished() = 0;
+    // returns once finished, with value set
+    virtual void wait() = 0;
+    virtual ~future_state() {}
+  };
+
+  // The job points at this, so it is allocated and does not move.
+  template <class T, class F>
+  struct future_task : future_state<T> {
+    F f;
+#if defined(HOMEGROWN)
+    fork_join_scheduler::Job job;
+    future_task(F&& f)
+      : f(std::move(f)), job(*this, fork_join_scheduler::Job::root_tag()) {}
+    bool finished() { return job.finished(); }
+    void wait() {
+      using Job = fork_join_scheduler::Job;
+      if (job.finished()) return;
+      if (fj.sched->withdraw(&job)) job();
+      else fj.sched->help([&] (Job* j) {return j->root_job() == &job;},
+			  [&] () {return job.finished();});
+    }
+#else
+    future_task(F&& f) : f(std::move(f)) {}
+    bool finished() { return this->value.has_value(); }
+    void wait() {}
+#endif
+    void operator()() {
+      if constexpr (std::is_void<T>::value) {f(); this->value.emplace();}
+      else this->value.emplace(f());
+    }
+  };
+
+  template <class T>
+  class future {
+  public:
+    using value_type = T;
+
+    future() {}
+    explicit future(future_state<T>* s) : state(s) {}
+    future(future&&) = default;
+    future& operator=(future&& other) {
+      wait();
+      state = std::move(other.state);
+      return *this;
+    }
+    ~future() { wait(); }
+
+    bool valid() const { return state != nullptr; }
+    bool is_ready() const { return state && state->finished(); }
+
+    void wait() { if (state) state->wait(); }
+
+    // Waits until ready and returns the result.  Can only be called once.
+    T get() {
+      wait();
+      std::unique_ptr<future_state<T>> s = std::move(state);
+      if constexpr (!std::is_void<T>::value) return std::move(*s->value);
+    }
+
+    // As get(), but returns empty for a void future (used by when_all).
+    future_value_t<T> get_value() {
+      wait();
+      std::unique_ptr<future_state<T>> s = std::move(state);
+      return std::move(*s->value);
+    }
+
+  private:
+    std::unique_ptr<future_state<T>> state;
+  };
+
+  template <class F>
+  auto spawn_in_lane(F f, [[maybe_unused]] int lane)
+    -> future<decltype(f())> {
+    using T = decltype(f());
+    auto task = new future_task<T,F>(std::move(f));
+#if defined(HOMEGROWN)
+    fj.sched->submit(&task->job, lane);
+#else
+    (*task)();
+#endif
+    return future<T>(task);
+  }
+
+  // Runs f() asynchronously, returning a future for its result.
+  // It runs at the priority of the caller (see with_priority).
+  template <class F>
+  auto spawn(F f) -> future<decltype(f())> {
+#if defined(HOMEGROWN)
+    return spawn_in_lane(std::move(f), scheduler<fork_join_scheduler::Job>::lane);
+#else
+    return spawn_in_lane(std::move(f), normal_priority);
+#endif
+  }
+
+  // As above, but f() and everything it forks run at priority p.
+  template <class F>
+  auto spawn(F f, job_priority p) -> future<decltype(f())> {
+    return spawn_in_lane(std::move(f), p);
+  }
+
+  template <class Futures>
+  struct is_future_vector : std::false_type {};
+  template <class T>
+  struct is_future_vector<std::vector<future<T>>> : std::true_type {};
+
+  // The state of a when_all, which holds the futures.  It is not a job,
+  // so nothing blocks on them in a task.  It is finished once they all
+  // are, counting the ones known to be finished so each is checked
+  // until it is, and waiting on it waits on each of them in turn.
+  template <class R, class Futures, class Collect>
+  struct when_all_state : future_state<R> {
+    Futures fs;
+    size_t num_ready = 0;
+    when_all_state(Futures&& fs) : fs(std::move(fs)) {}
+
+    // applies g to the futures after the first i, in order, while it
+    // returns true, incrementing i for each
+    template <class G>
+    static bool all(Futures& fs, size_t& i, G g) {
+      if constexpr (is_future_vector<Futures>::value) {
+	for (; i < fs.size(); i++) if (!g(fs[i])) return false;
+	return true;
+      } else
+	return std::apply([&] (auto&... f) {
+	    size_t j = 0;
+	    auto step = [&] (auto& f) {
+	      if (j++ < i) return true;
+	      if (!g(f)) return false;
+	      i++;
+	      return true;};
+	    return (step(f) && ...);}, fs);
+    }
+
+    bool finished() {
+      return this->value.has_value() ||
+	all(fs, num_ready, [] (auto& f) {return f.is_ready();});
+    }
+
+    void wait() {
+      if (this->value.has_value()) return;
+      all(fs, num_ready, [] (auto& f) {f.wait(); return true;});
+      this->value.emplace(Collect()(fs));
+    }
+  };
+
+  // A future for a tuple of the results of the futures, which are
+  // moved into it.  Void results are returned as empty.
+  template <class... Ts>
+  auto when_all(future<Ts>&&... fs)
+    -> future<std::tuple<future_value_t<Ts>...>> {
+    using R = std::tuple<future_value_t<Ts>...>;
+    using Futures = std::tuple<future<Ts>...>;
+    struct collect {
+      R operator()(Futures& fs) {
+	return std::apply([] (auto&... f) {return R{f.get_value()...};}, fs);}
+    };
+    return future<R>(new when_all_state<R, Futures, collect>(
+		       Futures(std::move(fs)...)));
+  }
+
+  // A future for a vector of the results of the futures.
+  template <class T>
+  auto when_all(std::vector<future<T>>&& fs)
+    -> future<std::vector<future_value_t<T>>> {
+    using R = std::vector<future_value_t<T>>;
+    using Futures = std::vector<future<T>>;
+    struct collect {
+      R operator()(Futures& fs) {
+	R r;
+	r.reserve(fs.size());
+	for (auto& f : fs) r.push_back(f.get_value());
+	return r;}
+    };
+    return future<R>(new when_all_state<R, Futures, collect>(std::move(fs)));
+  }
+}
@@ -96,6 +96,7 @@ namespace pbbs {
     using T = typename SeqIn::value_type;
     size_t n = In.size();
     timer t("integer sort",false);
+    alloc_tag tag("integer_sort");
     size_t cache_per_thread = 1000000;
     size_t base_bits = log2_up(2 * (size_t) sizeof(T) * n / cache_per_thread);
     // keep between 8 and 13
@@ -33,6 +33,7 @@
 #include <stdlib.h>
 #include <math.h>
 #include <atomic>
+#include <algorithm>
 #include "concurrent_stack.h"
 #include "utilities.h"
 #include "random_shuffle.h"
@@ -64,6 +65,7 @@ class list_allocator {
 
   static block_p initialize_list(block_p);
   static block_p get_list();
+  static void push_local(int id, block_p new_node);
 
  public:
   static bool initialized;
@@ -80,6 +82,7 @@ class list_allocator {
   static size_t num_used_bytes();
   static void print_stats();
   static void rand_shuffle();
+  static void set_thread_count(int n);
 
  private:
   static concurrent_stack<block_p> pool_roots;
@@ -223,10 +226,37 @@ void list_allocator<T>::reserve(size_t n,
   if (randomize) rand_shuffle();
 }
 
+// Resizes the local lists to n workers, moving the blocks held by
+// removed workers to the list of worker 0.
+// Not safe to run concurrently with alloc or free.
+template<typename T>
+void list_allocator<T>::set_thread_count(int n) {
+    if (!initialized) return;
+    thread_list* old_lists = local_lists;
+    int old_count = thread_count;
+    local_lists = new thread_list[n];
+    thread_count = n;
+    for (int i = 0; i < std::min(old_count, n); i++)
+      local_lists[i] = old_lists[i];
+    for (int i = n; i < old_count; i++)
+      while (old_lists[i].sz > 0) {
+        block_p p = old_lists[i].head;
+        old_lists[i].head = p->next;
+        old_lists[i].sz--;
+        push_local(0, p);
+      }
+    delete[] old_lists;
+}
+
 template<typename T>
 void list_allocator<T>::init(size_t _alloc_size, size_t _list_size) {
     if (initialized) return;
     initialized = true;
+    static bool hook_added = false;
+    if (!hook_added) {
+      add_worker_resize_hook(set_thread_count);
+      hook_added = true;
+    }
     blocks_allocated = 0;
 
     list_length = _list_size;
@@ -259,11 +289,10 @@ void list_allocator<T>::finish() {
     initialized = false;
 }
 
+// Pushes onto the local list of worker id, returning list_length
+// blocks to the global pool when it reaches 2*list_length.
 template<typename T>
-void list_allocator<T>::free(T* node) {
-    block_p new_node = (block_p) node;
-    int id = worker_id();
-
+inline void list_allocator<T>::push_local(int id, block_p new_node) {
     if (local_lists[id].sz == list_length+1) {
       local_lists[id].mid = local_lists[id].head;
     } else if (local_lists[id].sz == 2*list_length) {
@@ -276,8 +305,16 @@ void list_allocator<T>::free(T* node) {
     local_lists[id].sz++;
 }
 
+template<typename T>
+void list_allocator<T>::free(T* node) {
+    race_forget(node, sizeof(T));
+    race_ignore ignore;
+    push_local(worker_id(), (block_p) node);
+}
+
 template<typename T>
 inline T* list_allocator<T>::alloc() {
+    race_ignore ignore;
     int id = worker_id();
 
     if (!local_lists[id].sz)  {
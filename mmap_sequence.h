@@ -0,0 +1,155 @@
+// A sequence backed by a memory mapped file, so results (e.g. suffix
+// arrays or sorted edge lists) can be written to disk and reopened
+// without reading or copying them, e.g.
+//    auto SA = mmap_sequence<uint>::create("text.sa", suffix_array<uint>(s));
+//    ...
+//    auto SA = mmap_sequence<uint>::open("text.sa");
+// The file holds just the elements (no header), so its length has to
+// be a multiple of sizeof(T), and T has to be trivially copyable.
+// Modes:
+//    read_only  : writing an element faults
+//    read_write : writes go to the file (when the pages are written
+//                 back, or on flush)
+// Pages are read in and dropped by the kernel as needed, so a large
+// sequence uses page cache rather than the pbbs heap.
+// Supports size(), operator[], begin(), end(), slice() (giving a
+// range<T*>) and so can be passed to the algorithms in sequence_ops.h.
+// It is movable but not copyable (to_sequence makes a copy on the
+// heap).  The mapping is removed when it is destructed.
+// Errors (e.g. a missing file) throw std::runtime_error.
+
+#pragma once
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "utilities.h"
+#include "seq.h"
+
+namespace pbbs {
+
+  enum mmap_mode { read_only, read_write };
+
+  template <typename T>
+  struct mmap_sequence {
+    static_assert(std::is_trivially_copyable<T>::value,
+		  "mmap_sequence elements must be trivially copyable");
+  public:
+    using value_type = T;
+
+    mmap_sequence() : s(NULL), n(0) {}
+
+    mmap_sequence(mmap_sequence&& a) : s(a.s), n(a.n) {
+      a.s = NULL; a.n = 0;}
+
+    mmap_sequence& operator = (mmap_sequence&& a) {
+      if (this != &a) {
+	unmap();
+	s = a.s; n = a.n;
+	a.s = NULL; a.n = 0;
+      }
+      return *this;
+    }
+
+    mmap_sequence(const mmap_sequence&) = delete;
+    mmap_sequence& operator = (const mmap_sequence&) = delete;
+
+    ~mmap_sequence() { unmap(); }
+
+    // maps an existing file
+    static mmap_sequence open(std::string const &filename,
+			      mmap_mode mode = read_only) {
+      int fd = ::open(filename.c_str(), (mode == read_only) ? O_RDONLY : O_RDWR);
+      if (fd == -1) fail("open", filename);
+      struct stat sb;
+      if (fstat(fd, &sb) == -1) close_and_fail(fd, "fstat", filename);
+      if (!S_ISREG(sb.st_mode)) {
+	::close(fd);
+	throw std::runtime_error("mmap_sequence: not a file: " + filename);
+      }
+      size_t bytes = sb.st_size;
+      if (bytes % sizeof(T) != 0) {
+	::close(fd);
+	throw std::runtime_error("mmap_sequence: length of " + filename +
+				 " is not a multiple of the element size");
+      }
+      return mmap_sequence(fd, bytes / sizeof(T), mode, filename);
+    }
+
+    // creates (or truncates) a file of n elements, mapped read_write,
+    // its elements are initially zero
+    static mmap_sequence create(std::string const &filename, size_t n) {
+      int fd = ::open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+      if (fd == -1) fail("open", filename);
+      if (ftruncate(fd, n * sizeof(T)) == -1) close_and_fail(fd, "ftruncate", filename);
+      return mmap_sequence(fd, n, read_write, filename);
+    }
+
+    // creates a file holding a copy of A, copied in parallel
+    // (enable_if so create(filename, 0) picks the one above)
+    template <SEQ Seq,
+	      typename = std::enable_if_t<!std::is_integral<Seq>::value>>
+    static mmap_sequence create(std::string const &filename, Seq const &A) {
+      mmap_sequence r = create(filename, A.size());
+      T* start = r.begin();
+      parallel_for(0, A.size(), [&] (size_t i) {
+	  start[i] = A[i];}, 1000);
+      return r;
+    }
+
+    // writes modified pages back to the file, and waits until done
+    void flush() {
+      if (s != NULL && msync((void*) s, n * sizeof(T), MS_SYNC) == -1)
+	fail("msync", "");
+    }
+
+    value_type& operator[] (const size_t i) const {return s[i];}
+    size_t size() const {return n;}
+    value_type* begin() const {return s;}
+    value_type* end() const {return s + n;}
+
+    range<value_type*> slice(size_t ss, size_t ee) const {
+      return range<value_type*>(s + ss, s + ee);}
+    range<value_type*> slice() const {return slice(0, n);}
+
+  private:
+    T* s;
+    size_t n;
+
+    [[noreturn]] static void fail(const char* call, std::string const &filename) {
+      throw std::runtime_error(std::string("mmap_sequence: ") + call + " " +
+			       filename + ": " + std::strerror(errno));
+    }
+
+    [[noreturn]] static void close_and_fail(int fd, const char* call,
+					    std::string const &filename) {
+      int e = errno;
+      ::close(fd);
+      errno = e;
+      fail(call, filename);
+    }
+
+    // maps n elements of an open file, and closes it
+    mmap_sequence(int fd, size_t n, mmap_mode mode, std::string const &filename)
+      : s(NULL), n(n) {
+      if (n > 0) {
+	int prot = (mode == read_only) ? PROT_READ : PROT_READ | PROT_WRITE;
+	void* p = mmap(NULL, n * sizeof(T), prot, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) close_and_fail(fd, "mmap", filename);
+	s = (T*) p;
+      }
+      ::close(fd);
+    }
+
+    void unmap() {
+      if (s != NULL) munmap((void*) s, n * sizeof(T));
+      s = NULL; n = 0;
+    }
+  };
+}
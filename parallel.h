@@ -1,5 +1,8 @@
 #pragma once
 
+#include <atomic>
+#include <cstddef>
+
 //***************************************
 // All the pbbs library uses only four functions for
 // accessing parallelism.
@@ -12,6 +15,12 @@ static int num_workers();
 // id of running thread, should be numbered from [0...num-workers)
 static int worker_id();
 
+// NUMA node of running thread, numbered from [0...num_worker_nodes())
+// Workers are only placed on nodes by some schedulers (e.g. HOMEGROWN
+// with PIN_THREADS set), otherwise all workers are on node 0.
+static int worker_node();
+static int num_worker_nodes();
+
 // the granularity of a simple loop (e.g. adding one to each element
 // of an array) to reasonably hide cost of scheduler
 // #define PAR_GRANULARITY 2000
@@ -27,12 +36,77 @@ static void parallel_for(long start, long end, F f,
 			 long granularity = 0,
 			 bool conservative = false);
 
+// a flag for stopping a parallel_for early
+struct cancel_token {
+  std::atomic<bool> flag{false};
+  void cancel() { flag.store(true, std::memory_order_relaxed); }
+  bool cancelled() const { return flag.load(std::memory_order_relaxed); }
+};
+
+// as above, but stops early once tok.cancel() is called, e.g. by f
+//    when a search has found its answer.  Iterations that have not
+//    started are skipped, but some may run after the cancel.
+template <typename F>
+static void parallel_for(long start, long end, F f, cancel_token& tok,
+			 long granularity = 0,
+			 bool conservative = false);
+
 // runs the thunks left and right in parallel.
 //    both left and write should map void to void
 //    conservative uses a safer scheduler
 template <typename Lf, typename Rf>
 static void par_do(Lf left, Rf right, bool conservative=false);
 
+// runs f(0), ..., f(k-1) in parallel.
+//    f should map size_t to void
+//    forks all k at once with a single join, where the scheduler
+//    supports it, rather than as a tree of par_do's
+template <typename F>
+static void par_do_n(size_t k, F f, bool conservative=false);
+
+// priorities, see with_priority
+enum job_priority { high_priority = 0, normal_priority = 1 };
+
+// runs f() with everything it forks at priority p, e.g. a latency
+//    sensitive query while a batch job runs.  Idle workers take high
+//    priority work first.  Only HOMEGROWN has priorities, the other
+//    schedulers just run f().
+template <typename F>
+static void with_priority(job_priority p, F f);
+
+// changes the number of workers.
+//    should only be called when no parallel work is running
+static void set_num_workers(int n);
+
+//***************************************
+
+#include <functional>
+#include <mutex>
+#include <vector>
+
+// Per-worker state kept outside of the scheduler (e.g. the thread
+// local lists in the allocators) registers a hook, which is run with
+// the new number of workers whenever set_num_workers is called.
+inline std::vector<std::function<void(int)>>& worker_resize_hooks() {
+  static auto hooks = new std::vector<std::function<void(int)>>();
+  return *hooks;
+}
+
+inline std::mutex& worker_resize_hooks_mutex() {
+  static std::mutex m;
+  return m;
+}
+
+inline void add_worker_resize_hook(std::function<void(int)> f) {
+  std::lock_guard<std::mutex> lock(worker_resize_hooks_mutex());
+  worker_resize_hooks().push_back(f);
+}
+
+inline void run_worker_resize_hooks(int n) {
+  std::lock_guard<std::mutex> lock(worker_resize_hooks_mutex());
+  for (auto& f : worker_resize_hooks()) f(n);
+}
+
 //***************************************
 
 // cilkplus
@@ -45,12 +119,15 @@ static void par_do(Lf left, Rf right, bool conservative=false);
 
 inline int num_workers() {return __cilkrts_get_nworkers();}
 inline int worker_id() {return __cilkrts_get_worker_number();}
+inline int worker_node() {return 0;}
+inline int num_worker_nodes() {return 1;}
 inline void set_num_workers(int n) {
   __cilkrts_end_cilk();
   std::stringstream ss; ss << n;
   if (0 != __cilkrts_set_param("nworkers", ss.str().c_str())) {
     throw std::runtime_error("failed to set worker count!");
   }
+  run_worker_resize_hooks(num_workers());
 }
 
 template <typename F>
@@ -70,6 +147,14 @@ inline void parallel_for(long start, long end, F f,
   }
 }
 
+template <class F>
+inline void parallel_for(long start, long end, F f, cancel_token& tok,
+			 long granularity,
+			 bool conservative) {
+  parallel_for(start, end, [&] (long i) {if (!tok.cancelled()) f(i);},
+	       granularity, conservative);
+}
+
 template <class F>
 inline void mcsl_for(long start, long end, F f,
                      long granularity=0,
@@ -84,6 +169,19 @@ inline void par_do(Lf left, Rf right, bool conservative) {
     cilk_sync;
 }
 
+template <typename F>
+inline void par_do_n(size_t k, F f, bool conservative) {
+  if (k == 0) return;
+  for (size_t i=0; i < k-1; i++) cilk_spawn f(i);
+  f(k-1);
+  cilk_sync;
+}
+
+template <typename F>
+inline void with_priority(job_priority, F f) {
+  f();
+}
+
 template <typename Job>
 inline void parallel_run(Job job, int num_threads=0) {
   job();
@@ -96,42 +194,83 @@ inline void parallel_run(Job job, int num_threads=0) {
 
 inline int num_workers() { return omp_get_max_threads(); }
 inline int worker_id() { return omp_get_thread_num(); }
-inline void set_num_workers(int n) { omp_set_num_threads(n); }
+inline int worker_node() { return 0; }
+inline int num_worker_nodes() { return 1; }
+inline void set_num_workers(int n) {
+  omp_set_num_threads(n);
+  run_worker_resize_hooks(num_workers());
+}
+
+// Runs f() on one thread of a parallel region, so that everything it
+// forks is a task in that region.  A region is only started when the
+// calling thread is not already in one (omp_get_level is per thread),
+// so nested par_do's and parallel_for's just add tasks to it.
+template <class F>
+inline void omp_region(F const& f) {
+  if (omp_get_level() > 0) f();
+  else {
+#pragma omp parallel
+#pragma omp single
+    f();
+  }
+}
 
 template <class F>
 inline void parallel_for(long start, long end, F f,
+			 long granularity,
+			 bool) {
+  if (end <= start) return;
+  if (granularity == 0) {
+    long g = (end - start) / (8 * num_workers());
+    granularity = (g > 0) ? g : 1;
+  }
+  omp_region([&] {
+#pragma omp taskloop grainsize(granularity)
+      for (long i=start; i<end; i++) f(i);
+    });
+}
+
+template <class F>
+inline void parallel_for(long start, long end, F f, cancel_token& tok,
 			 long granularity,
 			 bool conservative) {
-  _Pragma("omp parallel for")
-    for(long i=start; i<end; i++) f(i);
+  parallel_for(start, end, [&] (long i) {if (!tok.cancelled()) f(i);},
+	       granularity, conservative);
 }
 
-bool in_par_do = false;
+template <class F>
+inline void mcsl_for(long start, long end, F f,
+                     long granularity=0,
+                     bool conservative=false) {
+  parallel_for(start, end, f, granularity, conservative);
+}
 
 template <typename Lf, typename Rf>
-inline void par_do(Lf left, Rf right, bool conservative) {
-  if (!in_par_do) {
-    in_par_do = true;  // at top level start up tasking
-#pragma omp parallel
-#pragma omp single
+inline void par_do(Lf left, Rf right, bool) {
+  omp_region([&] {
 #pragma omp task
-    left();
-#pragma omp task
-    right();
+      left();
+      right();
 #pragma omp taskwait
-    in_par_do = false;
-  } else {   // already started
-#pragma omp task
-    left();
-#pragma omp task
-    right();
-#pragma omp taskwait
-  }
+    });
+}
+
+template <typename F>
+inline void par_do_n(size_t k, F f, bool conservative) {
+  parallel_for(0, k, f, 1, conservative);
+}
+
+template <typename F>
+inline void with_priority(job_priority, F f) {
+  f();
 }
 
+// Runs job in a single parallel region, so that the region is not
+// started again for each top level par_do or parallel_for in it.
 template <typename Job>
 inline void parallel_run(Job job, int num_threads=0) {
-  job();
+  if (num_threads > 0) omp_set_num_threads(num_threads);
+  omp_region(job);
 }
 
 // Guy's scheduler (ABP)
@@ -142,6 +281,14 @@ inline void parallel_run(Job job, int num_threads=0) {
 extern fork_join_scheduler fj;
 #else
 fork_join_scheduler fj;
+
+// Per-worker state can be sized before fj is constructed (e.g. by a
+// static constructor in a translation unit built with NOTMAIN), from
+// default_num_workers, so it is resized once the scheduler is up.
+struct __fj_started {
+  __fj_started() { run_worker_resize_hooks(fj.num_workers()); }
+};
+static __fj_started __fj_started_var;
 #endif
 
 // Calls fj.destroy() before the program exits
@@ -154,26 +301,48 @@ static __atexit __atexit_var;
 
 #define PAR_GRANULARITY 512
 
+// Before fj is constructed only the calling thread runs, as worker 0,
+// and parallel loops and forks run serially on it.
 inline int num_workers() {
-  return fj.num_workers();
+  return fj.sched ? fj.num_workers() : default_num_workers();
 }
 
 inline int worker_id() {
-  return fj.worker_id();
+  return fj.sched ? fj.worker_id() : 0;
+}
+
+inline int worker_node() {
+  return fj.sched ? fj.worker_node() : 0;
+}
+
+inline int num_worker_nodes() {
+  return fj.sched ? fj.num_nodes() : 1;
 }
 
 inline void set_num_workers(int n) {
   fj.set_num_workers(n);
+  run_worker_resize_hooks(num_workers());
 }
 
 template <class F>
 inline void parallel_for(long start, long end, F f,
 			 long granularity,
 			 bool conservative) {
-  if (end > start)
+  if (!fj.sched) for (long i = start; i < end; i++) f(i);
+  else if (end > start)
     fj.parfor(start, end, f, granularity, conservative);
 }
 
+template <class F>
+inline void parallel_for(long start, long end, F f, cancel_token& tok,
+			 long granularity,
+			 bool conservative) {
+  if (!fj.sched) {
+    for (long i = start; i < end && !tok.cancelled(); i++) f(i);
+  } else if (end > start)
+    fj.parfor(start, end, f, granularity, conservative, &tok.flag);
+}
+
 template <class F>
 inline void mcsl_for(long start, long end, F f,
                      long granularity=0,
@@ -183,7 +352,20 @@ inline void mcsl_for(long start, long end, F f,
 
 template <typename Lf, typename Rf>
 inline void par_do(Lf left, Rf right, bool conservative) {
-  return fj.pardo(left, right, conservative);
+  if (!fj.sched) {left(); right();}
+  else fj.pardo(left, right, conservative);
+}
+
+template <typename F>
+inline void par_do_n(size_t k, F f, bool conservative) {
+  if (!fj.sched) for (size_t i = 0; i < k; i++) f(i);
+  else fj.pardo_n(0, k, f, conservative);
+}
+
+template <typename F>
+inline void with_priority(job_priority p, F f) {
+  if (!fj.sched) f();
+  else fj.run_at_priority(p, f);
 }
 
 template <typename Job>
@@ -194,8 +376,12 @@ inline void parallel_run(Job job, int) {
 #elif defined(MCSL)
 #include "mcsl_fjnative.hpp"
 
-inline int num_workers() { return 72;} // for now, use conservative value, because it's needed statically by block_allocator
+// for now, a conservative value, since the allocators size their
+// worker lists from it when first used, which can be before MCSL starts
+inline int num_workers() { return 72;}
 inline int worker_id() { return (int)mcsl::perworker::unique_id::get_my_id();}
+inline int worker_node() { return 0; }
+inline int num_worker_nodes() { return 1; }
 inline void set_num_workers(int n) { ; }
 #define PAR_GRANULARITY 2000
 
@@ -250,6 +436,24 @@ inline void parallel_for(long start, long end, F f,
   } else parfor_(start, end, f, granularity, conservative);
 }
 
+template <class F>
+inline void parallel_for(long start, long end, F f, cancel_token& tok,
+			 long granularity,
+			 bool conservative) {
+  parallel_for(start, end, [&] (long i) {if (!tok.cancelled()) f(i);},
+	       granularity, conservative);
+}
+
+template <typename F>
+inline void par_do_n(size_t k, F f, bool conservative) {
+  parfor_(0, k, f, 1, conservative);
+}
+
+template <typename F>
+inline void with_priority(job_priority, F f) {
+  f();
+}
+
 template <class F>
 inline void mcsl_for(long start, long end, F f,
                      long granularity=0,
@@ -268,11 +472,68 @@ inline void parallel_run(Job job, int num_threads=0) {
   job();
 }
 
+// serial, with random order and race checking (see race_check.h)
+#elif defined(RACE_CHECK)
+#include "race_check.h"
+
+inline int num_workers() { return 1;}
+inline int worker_id() { return 0;}
+inline int worker_node() { return 0;}
+inline int num_worker_nodes() { return 1;}
+inline void set_num_workers(int n) { ; }
+#define PAR_GRANULARITY 1000
+
+template <class F>
+inline void parallel_for(long start, long end, F f,
+			 long granularity,
+			 bool conservative) {
+  if (end > start)
+    race_check::fork(end - start, [&] (size_t i) {f(start + i);});
+}
+
+template <class F>
+inline void parallel_for(long start, long end, F f, cancel_token& tok,
+			 long granularity,
+			 bool conservative) {
+  if (end > start)
+    race_check::fork(end - start, [&] (size_t i) {
+	if (!tok.cancelled()) f(start + i);});
+}
+
+template <class F>
+inline void mcsl_for(long start, long end, F f,
+                     long granularity=0,
+                     bool conservative=false) {
+  parallel_for(start, end, f, granularity, conservative);
+}
+
+template <typename Lf, typename Rf>
+inline void par_do(Lf left, Rf right, bool conservative) {
+  race_check::fork(2, [&] (size_t i) {if (i == 0) left(); else right();});
+}
+
+template <typename F>
+inline void par_do_n(size_t k, F f, bool conservative) {
+  race_check::fork(k, f);
+}
+
+template <typename F>
+inline void with_priority(job_priority, F f) {
+  f();
+}
+
+template <typename Job>
+inline void parallel_run(Job job, int num_threads=0) {
+  job();
+}
+
 // c++
 #else
 
 inline int num_workers() { return 1;}
 inline int worker_id() { return 0;}
+inline int worker_node() { return 0;}
+inline int num_worker_nodes() { return 1;}
 inline void set_num_workers(int n) { ; }
 #define PAR_GRANULARITY 1000
 
@@ -285,6 +546,15 @@ inline void parallel_for(long start, long end, F f,
   }
 }
 
+template <class F>
+inline void parallel_for(long start, long end, F f, cancel_token& tok,
+			 long granularity,
+			 bool conservative) {
+  for (long i=start; i<end && !tok.cancelled(); i++) {
+    f(i);
+  }
+}
+
 template <class F>
 inline void mcsl_for(long start, long end, F f,
                      long granularity=0,
@@ -297,9 +567,66 @@ inline void par_do(Lf left, Rf right, bool conservative) {
   left(); right();
 }
 
+template <typename F>
+inline void par_do_n(size_t k, F f, bool conservative) {
+  for (size_t i=0; i < k; i++) f(i);
+}
+
+template <typename F>
+inline void with_priority(job_priority, F f) {
+  f();
+}
+
 template <typename Job>
 inline void parallel_run(Job job, int num_threads=0) {
   job();
 }
 
 #endif
+
+// Only used with RACE_CHECK, see race_check.h
+#if !defined(RACE_CHECK)
+struct race_ignore { race_ignore() {} };
+inline void race_forget(void*, size_t) {}
+#endif
+
+//***************************************
+
+// A copy of a T for each worker, each on its own cache lines, for
+// accumulating in parallel without contention, e.g.
+//   worker_local<long> sums(0);
+//   parallel_for(0, n, [&] (long i) {sums.get() += A[i];});
+//   long total = sums.combine(pbbs::addm<long>());
+// get() returns the copy of the running worker.  A worker can start
+// other work while it waits at a fork, so the reference should not be
+// kept across a par_do or parallel_for.  combine takes a monoid (with
+// fields m.identity and m.f, see monoid.h) and should only be called
+// when no parallel work is using the copies.  The number of workers
+// should not change while it is alive.
+template <typename T>
+class worker_local {
+  // two cache lines, since the adjacent line is often prefetched
+  struct alignas(128) slot { T value; };
+  std::vector<slot> slots;
+
+public:
+  worker_local(T const& init = T())
+    : slots(num_workers(), slot{init}) {}
+
+  T& get() {
+    T& r = slots[worker_id()].value;
+    // every strand has its own copy as far as RACE_CHECK is concerned
+    race_forget(&r, sizeof(T));
+    return r;
+  }
+
+  size_t size() const { return slots.size(); }
+  T& operator[] (size_t i) { return slots[i].value; }
+
+  template <class M>
+  T combine(M const& m) const {
+    T r = m.identity;
+    for (auto const& s : slots) r = m.f(r, s.value);
+    return r;
+  }
+};
@@ -0,0 +1,414 @@
+#pragma once
+
+// A debugging scheduler, selected with -DRACE_CHECK (see parallel.h).
+// It runs everything on one thread.  The branches of each par_do and
+// the iterations of each parallel_for run in a random order chosen
+// from a seed.  Determinacy races between them are checked with the
+// SP-bags algorithm (Feng and Leiserson, SPAA 1997), which tracks
+// for every byte of shadow memory the last writer and a reader and
+// checks whether they are logically in parallel with the current
+// strand.
+//
+// Memory accesses are found by compiling with -fsanitize=thread but
+// linking without the ThreadSanitizer runtime (see test_scheduler_RC
+// in the makefile), so that the instrumentation calls the __tsan_*
+// hooks below.  Without the instrumentation only the random order is
+// used, which is still useful for comparing results across seeds.
+//
+// The seed is taken from RACE_SEED, otherwise from the clock, and is
+// printed with each report so the same order can be replayed.
+// Setting RACE_ABORT aborts on the first race.  Each reported race
+// names the binary and offset of the access, to pass to addr2line.
+//
+// Limitations: accesses inside memcpy, memset and other library code
+// that is not compiled in are not seen.  Atomics never race.  The
+// pbbs allocators mark their bookkeeping with race_ignore and forget
+// freed memory with race_forget, and delete forgets the memory it
+// frees, so reuse of memory is not a race.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <random>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <dlfcn.h>
+#include <malloc.h>
+#include <pthread.h>
+
+#define RACE_NOINST __attribute__((no_sanitize_thread, noinline))
+
+namespace race_check {
+
+  struct cell {
+    int32_t reader; // 0 if none
+    int32_t writer;
+  };
+
+  struct detector {
+    RACE_NOINST detector() {
+      const char* s = std::getenv("RACE_SEED");
+      seed = s ? std::strtoull(s, nullptr, 10)
+	: (uint64_t) std::chrono::steady_clock::now().time_since_epoch().count();
+      rng.seed(seed);
+      abort_on_race = std::getenv("RACE_ABORT") != nullptr;
+      parent = {0, 1};
+      p_bag = {0, 0};
+      frames.push_back(frame{1, 0}); // the root
+      pthread_attr_t attr;
+      void* addr; size_t size;
+      stack_lo = stack_hi = 0;
+      if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+	if (pthread_attr_getstack(&attr, &addr, &size) == 0) {
+	  stack_lo = (uintptr_t) addr;
+	  stack_hi = stack_lo + size;
+	}
+	pthread_attr_destroy(&attr);
+      }
+      stack_used = stack_hi;
+    }
+
+    // Random order for k strands.
+    RACE_NOINST std::vector<size_t> order(size_t k) {
+      std::vector<size_t> r(k);
+      for (size_t i=0; i < k; i++) r[i] = i;
+      std::shuffle(r.begin(), r.end(), rng);
+      return r;
+    }
+
+    // A strand forked by the current procedure starts.  Everything on
+    // the stack below the frame of the fork (sp) belongs to finished
+    // strands, so forget it.
+    RACE_NOINST void begin_strand(uintptr_t sp) {
+      int id = (int) parent.size();
+      parent.push_back(id);
+      p_bag.push_back(0);
+      frames.push_back(frame{id, 0});
+      if (stack_used < sp) forget(stack_used, sp - stack_used);
+      stack_used = sp;
+    }
+
+    // It finishes, so its S-bag joins the parent's P-bag.
+    RACE_NOINST void end_strand() {
+      int c = frames.back().id;
+      frames.pop_back();
+      frame& f = frames.back();
+      if (f.p == 0) f.p = c;
+      else unite(f.p, c);
+      p_bag[find(c)] = 1;
+    }
+
+    // The current procedure joins its strands, so its P-bag joins its
+    // S-bag.
+    RACE_NOINST void sync() {
+      frame& f = frames.back();
+      if (f.p == 0) return;
+      unite(f.id, f.p);
+      p_bag[find(f.id)] = 0;
+      f.p = 0;
+    }
+
+    // A read races with a write by a strand in a P-bag.  The reader is
+    // replaced unless it is in a P-bag, since a later write that races
+    // with the current strand would also race with it.
+    RACE_NOINST void read(uintptr_t a, size_t n, void* pc) {
+      int cur = frames.back().id;
+      char const* race = nullptr;
+      for (size_t i=0; i < n; i++) {
+	cell& c = get_cell(a + i);
+	if (!race && in_p_bag(c.writer)) race = "write/read";
+	if (!in_p_bag(c.reader)) c.reader = cur;
+      }
+      if (race) report(race, a, pc);
+      note_stack(a);
+    }
+
+    // A write races with a read or write by a strand in a P-bag.
+    RACE_NOINST void write(uintptr_t a, size_t n, void* pc) {
+      int cur = frames.back().id;
+      char const* race = nullptr;
+      for (size_t i=0; i < n; i++) {
+	cell& c = get_cell(a + i);
+	if (!race && in_p_bag(c.reader)) race = "read/write";
+	if (!race && in_p_bag(c.writer)) race = "write/write";
+	c.writer = cur;
+      }
+      if (race) report(race, a, pc);
+      note_stack(a);
+    }
+
+    // Drops the history of [a, a+n), e.g. because it was freed.
+    RACE_NOINST void forget(uintptr_t a, size_t n) {
+      uintptr_t end = a + n;
+      while (a < end) {
+	uintptr_t page = a >> log_page;
+	uintptr_t page_end = std::min(end, (page + 1) << log_page);
+	auto it = pages.find(page);
+	if (it != pages.end())
+	  std::memset(it->second + (a & page_mask), 0,
+		      (page_end - a) * sizeof(cell));
+	a = page_end;
+      }
+    }
+
+    size_t num_races = 0;
+    uint64_t seed;
+
+  private:
+    struct frame {
+      int id; // also in the S-bag
+      int p;  // any member of the P-bag, 0 if empty
+    };
+
+    // union-find over strands, each set is an S-bag or a P-bag
+    std::vector<int> parent;
+    std::vector<char> p_bag; // only valid for roots
+    std::vector<frame> frames;
+
+    // shadow memory, one cell per byte, allocated a page at a time
+    static constexpr int log_page = 12;
+    static constexpr uintptr_t page_mask = (1 << log_page) - 1;
+    std::unordered_map<uintptr_t, cell*> pages;
+    uintptr_t last_page = ~((uintptr_t) 0);
+    cell* last_cells = nullptr;
+
+    uintptr_t stack_lo, stack_hi; // the stack of this thread
+    uintptr_t stack_used;         // lowest address with shadow
+
+    std::mt19937_64 rng;
+    bool abort_on_race;
+    std::unordered_set<void*> reported;
+
+    RACE_NOINST int find(int x) {
+      while (parent[x] != x) {
+	parent[x] = parent[parent[x]];
+	x = parent[x];
+      }
+      return x;
+    }
+
+    RACE_NOINST void unite(int x, int y) {
+      x = find(x); y = find(y);
+      if (x != y) parent[y] = x;
+    }
+
+    RACE_NOINST bool in_p_bag(int x) {
+      return x != 0 && p_bag[find(x)];
+    }
+
+    RACE_NOINST cell& get_cell(uintptr_t a) {
+      uintptr_t page = a >> log_page;
+      if (page != last_page) {
+	cell*& cells = pages[page];
+	if (cells == nullptr)
+	  cells = (cell*) std::calloc(page_mask + 1, sizeof(cell));
+	last_page = page;
+	last_cells = cells;
+      }
+      return last_cells[a & page_mask];
+    }
+
+    RACE_NOINST void note_stack(uintptr_t a) {
+      if (a >= stack_lo && a < stack_used) stack_used = a;
+    }
+
+    // Reports once per instruction.
+    RACE_NOINST void report(char const* kind, uintptr_t a, void* pc) {
+      num_races++;
+      if (reported.insert(pc).second) {
+	Dl_info info;
+	if (dladdr(pc, &info) && info.dli_fname)
+	  std::fprintf(stderr, "race check: %s race on %p at %s+%#lx (RACE_SEED=%lu)\n",
+		       kind, (void*) a, info.dli_fname,
+		       (unsigned long) ((char*) pc - (char*) info.dli_fbase),
+		       (unsigned long) seed);
+	else
+	  std::fprintf(stderr, "race check: %s race on %p at %p (RACE_SEED=%lu)\n",
+		       kind, (void*) a, pc, (unsigned long) seed);
+      }
+      if (abort_on_race) std::abort();
+    }
+  };
+
+  // Accesses are only checked while active, and not while the
+  // detector itself is running (it uses instrumented containers).
+  inline detector* the_detector = nullptr;
+  inline bool active = false;
+  inline int ignore_depth = 0;
+
+  RACE_NOINST inline void print_summary() {
+    if (the_detector->num_races > 0)
+      std::fprintf(stderr, "race check: %lu races (RACE_SEED=%lu)\n",
+		   (unsigned long) the_detector->num_races,
+		   (unsigned long) the_detector->seed);
+  }
+
+  RACE_NOINST inline detector& get() {
+    if (the_detector == nullptr) {
+      active = false;
+      the_detector = new detector;
+      std::atexit(print_summary);
+      active = true;
+    }
+    return *the_detector;
+  }
+
+  // Number of races found so far.
+  RACE_NOINST inline size_t num_races() {
+    return the_detector ? the_detector->num_races : 0;
+  }
+
+  RACE_NOINST inline std::vector<size_t> start_fork(size_t k) {
+    detector& d = get();
+    active = false;
+    std::vector<size_t> r = d.order(k);
+    active = true;
+    return r;
+  }
+
+  RACE_NOINST inline void begin_strand(void* sp) {
+    active = false; the_detector->begin_strand((uintptr_t) sp); active = true; }
+
+  RACE_NOINST inline void end_strand() {
+    active = false; the_detector->end_strand(); active = true; }
+
+  RACE_NOINST inline void end_fork() {
+    active = false; the_detector->sync(); active = true; }
+
+  RACE_NOINST inline void on_read(void* a, size_t n, void* pc) {
+    if (!active || ignore_depth > 0) return;
+    active = false; the_detector->read((uintptr_t) a, n, pc); active = true;
+  }
+
+  RACE_NOINST inline void on_write(void* a, size_t n, void* pc) {
+    if (!active || ignore_depth > 0) return;
+    active = false; the_detector->write((uintptr_t) a, n, pc); active = true;
+  }
+
+  RACE_NOINST inline void forget(void* a, size_t n) {
+    if (!active || a == nullptr) return;
+    active = false; the_detector->forget((uintptr_t) a, n); active = true;
+  }
+
+  // Runs f(0), ..., f(k-1) as parallel strands, in a random order.
+  template <class F>
+  void fork(size_t k, F const &f) {
+    std::vector<size_t> order = start_fork(k);
+    for (size_t j=0; j < k; j++) {
+      begin_strand(__builtin_frame_address(0));
+      f(order[j]);
+      end_strand();
+    }
+    end_fork();
+  }
+}
+
+// Accesses in the scope of a race_ignore are not checked.
+struct race_ignore {
+  RACE_NOINST race_ignore() { race_check::ignore_depth++; }
+  RACE_NOINST ~race_ignore() { race_check::ignore_depth--; }
+};
+
+// Forgets the history of memory that is being freed.
+RACE_NOINST inline void race_forget(void* p, size_t n) {
+  race_check::forget(p, n);
+}
+
+// The hooks called by -fsanitize=thread instrumentation.  Weak, so
+// that they can be included in several translation units.
+#define RACE_HOOK extern "C" __attribute__((weak, no_sanitize_thread))
+
+RACE_HOOK void __tsan_init() {}
+RACE_HOOK void __tsan_func_entry(void*) {}
+RACE_HOOK void __tsan_func_exit() {}
+
+#define RACE_RW(n)							\
+  RACE_HOOK void __tsan_read##n(void* a) {				\
+    race_check::on_read(a, n, __builtin_return_address(0)); }		\
+  RACE_HOOK void __tsan_write##n(void* a) {				\
+    race_check::on_write(a, n, __builtin_return_address(0)); }		\
+  RACE_HOOK void __tsan_unaligned_read##n(void* a) {			\
+    race_check::on_read(a, n, __builtin_return_address(0)); }		\
+  RACE_HOOK void __tsan_unaligned_write##n(void* a) {			\
+    race_check::on_write(a, n, __builtin_return_address(0)); }
+
+RACE_RW(1)
+RACE_RW(2)
+RACE_RW(4)
+RACE_RW(8)
+RACE_RW(16)
+
+RACE_HOOK void __tsan_read_range(void* a, unsigned long n) {
+  race_check::on_read(a, n, __builtin_return_address(0)); }
+RACE_HOOK void __tsan_write_range(void* a, unsigned long n) {
+  race_check::on_write(a, n, __builtin_return_address(0)); }
+RACE_HOOK void __tsan_vptr_read(void** a) {
+  race_check::on_read(a, sizeof(void*), __builtin_return_address(0)); }
+RACE_HOOK void __tsan_vptr_update(void** a, void*) {
+  race_check::on_write(a, sizeof(void*), __builtin_return_address(0)); }
+
+// Atomics are done directly (there is only one thread) and never race.
+#define RACE_ATOMIC(n, T)						\
+  RACE_HOOK T __tsan_atomic##n##_load(const volatile T* a, int) {	\
+    return *a; }							\
+  RACE_HOOK void __tsan_atomic##n##_store(volatile T* a, T v, int) {	\
+    *a = v; }								\
+  RACE_HOOK T __tsan_atomic##n##_exchange(volatile T* a, T v, int) {	\
+    T r = *a; *a = v; return r; }					\
+  RACE_HOOK T __tsan_atomic##n##_fetch_add(volatile T* a, T v, int) {	\
+    T r = *a; *a = r + v; return r; }					\
+  RACE_HOOK T __tsan_atomic##n##_fetch_sub(volatile T* a, T v, int) {	\
+    T r = *a; *a = r - v; return r; }					\
+  RACE_HOOK T __tsan_atomic##n##_fetch_and(volatile T* a, T v, int) {	\
+    T r = *a; *a = r & v; return r; }					\
+  RACE_HOOK T __tsan_atomic##n##_fetch_or(volatile T* a, T v, int) {	\
+    T r = *a; *a = r | v; return r; }					\
+  RACE_HOOK T __tsan_atomic##n##_fetch_xor(volatile T* a, T v, int) {	\
+    T r = *a; *a = r ^ v; return r; }					\
+  RACE_HOOK T __tsan_atomic##n##_fetch_nand(volatile T* a, T v, int) {	\
+    T r = *a; *a = ~(r & v); return r; }				\
+  RACE_HOOK int __tsan_atomic##n##_compare_exchange_strong(		\
+      volatile T* a, T* c, T v, int, int) {				\
+    if (*a == *c) {*a = v; return 1;}					\
+    *c = *a; return 0; }						\
+  RACE_HOOK int __tsan_atomic##n##_compare_exchange_weak(		\
+      volatile T* a, T* c, T v, int, int) {				\
+    if (*a == *c) {*a = v; return 1;}					\
+    *c = *a; return 0; }						\
+  RACE_HOOK T __tsan_atomic##n##_compare_exchange_val(			\
+      volatile T* a, T c, T v, int, int) {				\
+    T r = *a; if (r == c) *a = v; return r; }
+
+RACE_ATOMIC(8, char)
+RACE_ATOMIC(16, short)
+RACE_ATOMIC(32, int)
+RACE_ATOMIC(64, long)
+RACE_ATOMIC(128, __int128)
+
+RACE_HOOK void __tsan_atomic_thread_fence(int) {}
+RACE_HOOK void __tsan_atomic_signal_fence(int) {}
+
+// Memory freed by delete is forgotten, so that reusing it is not a race.
+#define RACE_DELETE __attribute__((weak, no_sanitize_thread))
+
+RACE_DELETE void operator delete(void* p) noexcept {
+  race_forget(p, malloc_usable_size(p)); std::free(p); }
+RACE_DELETE void operator delete[](void* p) noexcept {
+  race_forget(p, malloc_usable_size(p)); std::free(p); }
+RACE_DELETE void operator delete(void* p, size_t) noexcept {
+  race_forget(p, malloc_usable_size(p)); std::free(p); }
+RACE_DELETE void operator delete[](void* p, size_t) noexcept {
+  race_forget(p, malloc_usable_size(p)); std::free(p); }
+RACE_DELETE void operator delete(void* p, std::align_val_t) noexcept {
+  race_forget(p, malloc_usable_size(p)); std::free(p); }
+RACE_DELETE void operator delete[](void* p, std::align_val_t) noexcept {
+  race_forget(p, malloc_usable_size(p)); std::free(p); }
+RACE_DELETE void operator delete(void* p, size_t, std::align_val_t) noexcept {
+  race_forget(p, malloc_usable_size(p)); std::free(p); }
+RACE_DELETE void operator delete[](void* p, size_t, std::align_val_t) noexcept {
+  race_forget(p, malloc_usable_size(p)); std::free(p); }
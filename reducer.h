@@ -1,5 +1,10 @@
-#include <cilk/cilk.h>
-#include <cilk/reducer.h>
+#pragma once
+#include <array>
+#include "parallel.h"
+#include "monoid.h"
+
+// A histogram that is added to in parallel with a copy per worker
+// (see worker_local in parallel.h), so it works with any scheduler.
 
 template <class T, int n>
 struct histogram_view {
@@ -7,11 +12,11 @@ struct histogram_view {
   value_type hist ;
 
   histogram_view() {
-    for (size_t i=0; i < 6 ; i++) hist[i] = 0;
+    for (size_t i=0; i < (size_t) n; i++) hist[i] = 0;
   }
 
   void reduce(histogram_view* right) {
-    for (size_t i=0; i < 6; i++)
+    for (size_t i=0; i < (size_t) n; i++)
       hist[i] += right->hist[i];
   }
 
@@ -20,10 +25,17 @@ struct histogram_view {
 };
 
 template <class T, int n>
-using histogram_monoid = cilk::monoid_with_view<histogram_view<T,n>>;
+struct histogram_reducer {
+  using view = histogram_view<T,n>;
+  worker_local<view> views;
 
-template <class T, int n>
-using histogram_reducer = cilk::reducer<histogram_monoid<T,n>>;
+  view* operator->() { return &views.get(); }
+
+  typename view::value_type get_value() const {
+    auto add = [] (view a, view b) {a.reduce(&b); return a;};
+    return views.combine(pbbs::make_monoid(add, view())).view_get_value();
+  }
+};
 
 // use "histogram_reducer<int,n> r;" to define reducer with n int buckets
 // use "r->add_value(i)" to increment bucket i
@@ -37,6 +37,7 @@
 #include "transpose.h"
 #include "bucket_sort.h"
 #include "get_time.h"
+#include "arena_allocator.h"
 
 namespace pbbs {
 
@@ -119,6 +120,8 @@ namespace pbbs {
       small_sort_(In, Out, less, inplace, stable);
     } else {
       timer t("sample sort", false);
+      alloc_tag tag("sample_sort");
+      arena_scope scope;
       // The larger these are, the more comparisons are done but less
       // overhead for the transpose.
       size_t bucket_quotient = 4;
@@ -138,22 +141,23 @@ namespace pbbs {
       size_t m = num_blocks*num_buckets;
 
       // generate "random" samples with oversampling
-      sequence<T> sample_set(sample_set_size, [&] (size_t i) {
+      arena_sequence<T> sample_set(sample_set_size, [&] (size_t i) {
 	  return In[hash64(i)%n];});
 
       // sort the samples
       quicksort(sample_set.begin(), sample_set_size, less);
 
       // subselect samples at even stride
-      sequence<T> pivots(num_buckets-1, [&] (size_t i) {
+      arena_sequence<T> pivots(num_buckets-1, [&] (size_t i) {
 	  return sample_set[OVER_SAMPLE*i];});
 
-      sequence<T> Tmp = sequence<T>::no_init(n);
+      // counts before Tmp, so Tmp is the last allocation when freed
+      arena_sequence<s_size_t> counts(m+1);
+      counts[m] = 0;
+      arena_sequence<T> Tmp = arena_sequence<T>::no_init(n);
       t.next("head");
 
       // sort each block and merge with samples to get counts for each bucket
-      sequence<s_size_t> counts(m+1);
-      counts[m] = 0;
       sliced_for(n, block_size, [&] (size_t i, size_t start, size_t end) {
 	  seq_sort_(In.slice(start,end), Tmp.slice(start,end), less,
 		    inplace, stable);
@@ -171,7 +175,7 @@ namespace pbbs {
       Tmp.clear_no_destruct();
 
       // sort within each bucket
-      parallel_for (0, num_buckets, [&] (size_t i) {
+      par_do_n(num_buckets, [&] (size_t i) {
 	  size_t start = bucket_offsets[i];
 	  size_t end = bucket_offsets[i+1];
 
@@ -179,7 +183,7 @@ namespace pbbs {
 	  if (i == 0 || i == num_buckets - 1 || less(pivots[i-1],pivots[i])) {
 	    seq_sort_inplace(Out.slice(start,end), less, stable);
 	  }
-	},1);
+	});
       t.next("second sort");
     }
   }
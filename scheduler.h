@@ -1,10 +1,26 @@
 #pragma once
 
+#include <atomic>
+#include <cassert>
 #include <chrono>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
 #include <cstdint>
 #include <iostream>
 #include <functional>
+#include <stdexcept>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <iomanip>
+#include <algorithm>
+#include <deque>
+#include <new>
+#if defined(__linux__)
+#include <sched.h>
+#endif
 
 // EXAMPLE USE 1:
 //
@@ -33,108 +49,208 @@
 // init(a, n);
 
 
-// Deque from Arora, Blumofe, and Plaxton (SPAA, 1998).
+// Growable deque from Chase and Lev (SPAA, 2005), using the C++11
+// memory orderings given by Le, Pop, Cohen and Zappa Nardelli (PPoPP, 2013).
+// Only the owner pushes and pops at the bottom, thieves pop at the top.
+// When full the circular buffer is doubled.  Retired buffers are kept
+// until the deque is destroyed since a thief might still be reading one.
 template <typename Job>
 struct Deque {
-  using qidx = unsigned int;
-  using tag_t = unsigned int;
-
-  // use unit for atomic access
-  union age_t {
-    struct {
-      tag_t tag;
-      qidx top;
-    } pair;
-    size_t unit;
+  using qidx = int64_t;
+
+  struct circular_array {
+    qidx mask;
+    std::atomic<Job*>* buffer;
+    circular_array* prev; // retired buffer (smaller), freed on destruction
+
+    circular_array(qidx size, circular_array* prev)
+      : mask(size-1), buffer(new std::atomic<Job*>[size]), prev(prev) {}
+
+    ~circular_array() {
+      delete[] buffer;
+      delete prev;
+    }
+
+    qidx size() { return mask + 1; }
+
+    Job* get(qidx i) {
+      return buffer[i & mask].load(std::memory_order_relaxed); }
+
+    void put(qidx i, Job* job) {
+      buffer[i & mask].store(job, std::memory_order_relaxed); }
+
+    // returns a buffer of twice the size containing elements [t, b)
+    circular_array* grow(qidx b, qidx t) {
+      circular_array* a = new circular_array(2*size(), this);
+      for (qidx i=t; i < b; i++) a->put(i, get(i));
+      return a;
+    }
   };
 
-  // align to avoid false sharing
-  struct alignas(64) padded_job { Job* job;  };
+  static qidx const initial_size = 256;
+
+#if defined(SCHEDULER_STATS)
+  qidx high_water = 0; // largest number of jobs held, owner only
+#endif
+
+  // top and bot on separate cache lines to avoid false sharing
+  alignas(64) std::atomic<qidx> top;
+  alignas(64) std::atomic<qidx> bot;
+  std::atomic<circular_array*> array;
 
-  static int const q_size = 200;
-  age_t age;
-  qidx bot;
-  padded_job deq[q_size];
+  Deque() : top(0), bot(0), array(new circular_array(initial_size, NULL)) {}
 
-  inline bool cas(size_t* ptr, size_t oldv, size_t newv) {
-    return __sync_bool_compare_and_swap(ptr, oldv, newv);
+  ~Deque() { delete array.load(); }
+
+  void push_bottom(Job* job) {
+    qidx b = bot.load(std::memory_order_relaxed);
+    qidx t = top.load(std::memory_order_acquire);
+    circular_array* a = array.load(std::memory_order_relaxed);
+    if (b - t > a->size() - 1) { // full, so double the buffer
+      a = a->grow(b, t);
+      array.store(a, std::memory_order_release);
+    }
+    a->put(b, job);
+    std::atomic_thread_fence(std::memory_order_release);
+    bot.store(b + 1, std::memory_order_relaxed);
+#if defined(SCHEDULER_STATS)
+    high_water = std::max(high_water, b + 1 - t);
+#endif
   }
 
-  inline void fence() {
-    std::atomic_thread_fence(std::memory_order_seq_cst);
+  // Push jobs[n-1], ..., jobs[0] (so jobs[0] is popped first),
+  // publishing them all with a single update of bot.
+  void push_bottom_n(Job* jobs, qidx n) {
+    qidx b = bot.load(std::memory_order_relaxed);
+    qidx t = top.load(std::memory_order_acquire);
+    circular_array* a = array.load(std::memory_order_relaxed);
+    if (b + n - t > a->size()) {
+      while (b + n - t > a->size()) a = a->grow(b, t);
+      array.store(a, std::memory_order_release);
+    }
+    for (qidx j=0; j < n; j++) a->put(b + j, &jobs[n-1-j]);
+    std::atomic_thread_fence(std::memory_order_release);
+    bot.store(b + n, std::memory_order_relaxed);
+#if defined(SCHEDULER_STATS)
+    high_water = std::max(high_water, b + n - t);
+#endif
   }
 
-  Deque() : bot(0) {
-    age.pair.tag = 0;
-    age.pair.top = 0;
+  Job* pop_top() {
+    qidx t = top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    qidx b = bot.load(std::memory_order_acquire);
+    if (t >= b) return NULL; // empty
+    circular_array* a = array.load(std::memory_order_acquire);
+    Job* job = a->get(t);
+    if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+				     std::memory_order_relaxed))
+      return NULL; // lost race with another thief or the owner
+    return job;
   }
 
-  void push_bottom(Job* job) {
-    qidx local_bot;
-    local_bot = bot; // atomic load
-    deq[local_bot].job = job; // shared store
-    local_bot += 1;
-    if (local_bot == q_size) 
-      throw std::runtime_error("internal error: scheduler queue overflow");
-    bot = local_bot; // shared store
-    fence();
+  // As pop_top, but only takes the top job if pred(job) holds.  The
+  // job is alive when pred reads it if the pop then succeeds.
+  template <typename P>
+  Job* pop_top_if(P pred) {
+    qidx t = top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    qidx b = bot.load(std::memory_order_acquire);
+    if (t >= b) return NULL; // empty
+    circular_array* a = array.load(std::memory_order_acquire);
+    Job* job = a->get(t);
+    if (!pred(job)) return NULL;
+    if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+				     std::memory_order_relaxed))
+      return NULL; // lost race with another thief or the owner
+    return job;
   }
 
-  Job* pop_top() {
-    age_t old_age, new_age;
-    qidx local_bot;
-    Job *job, *result;
-    old_age.unit = age.unit; // atomic load
-
-    local_bot = bot; // atomic load
-    if (local_bot <= old_age.pair.top)
-      result = NULL;
-    else {
-      job = deq[old_age.pair.top].job; // atomic load
-      new_age.unit = old_age.unit;
-      new_age.pair.top = new_age.pair.top + 1;
-      if (cas(&(age.unit), old_age.unit, new_age.unit))  // cas
-	result = job;
-      else
-	result = NULL;
-    }
-    return result;
+  // only a hint since it can change concurrently
+  bool empty() {
+    return top.load(std::memory_order_relaxed) >=
+      bot.load(std::memory_order_relaxed);
   }
 
   Job* pop_bottom() {
-    age_t old_age, new_age;
-    qidx local_bot;
-    Job *job, *result;
-    local_bot = bot; // atomic load
-    if (local_bot == 0)
-      result = NULL;
-    else {
-      local_bot = local_bot - 1;
-      bot = local_bot; // shared store
-      fence();
-      job = deq[local_bot].job; // atomic load
-      old_age.unit = age.unit; // atomic load
-      if (local_bot > old_age.pair.top)
-	result = job;
-      else {
-	bot = 0; // shared store
-	new_age.pair.top = 0;
-	new_age.pair.tag = old_age.pair.tag + 1;
-	if ((local_bot == old_age.pair.top) &&
-	    cas(&(age.unit), old_age.unit, new_age.unit))
-	  result = job;
-	else {
-	  age.unit = new_age.unit; // shared store
+    qidx b = bot.load(std::memory_order_relaxed) - 1;
+    circular_array* a = array.load(std::memory_order_relaxed);
+    bot.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    qidx t = top.load(std::memory_order_relaxed);
+    Job* result = NULL;
+    if (t <= b) {
+      result = a->get(b);
+      if (t == b) { // last element, race against thieves
+	if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+					 std::memory_order_relaxed))
 	  result = NULL;
-	}
-	fence();
+	bot.store(b + 1, std::memory_order_relaxed);
       }
+    } else bot.store(b + 1, std::memory_order_relaxed); // was empty
+    return result;
+  }
+
+};
+
+// The NUMA nodes and the cpus on each, read from /sys on linux.
+// Only cpus in the affinity mask of the process are included.
+// Falls back to a single node with all cpus.
+struct numa_topology {
+  std::vector<std::vector<int>> node_cpus;
+
+  numa_topology() {
+#if defined(__linux__)
+    cpu_set_t mask;
+    bool have_mask = (sched_getaffinity(0, sizeof(mask), &mask) == 0);
+    std::ifstream online("/sys/devices/system/node/online");
+    std::string nodes;
+    if (online && std::getline(online, nodes))
+      for (int node : parse_list(nodes)) {
+	std::ifstream f("/sys/devices/system/node/node" +
+			std::to_string(node) + "/cpulist");
+	std::string list;
+	if (!f || !std::getline(f, list)) continue;
+	std::vector<int> cpus;
+	for (int cpu : parse_list(list))
+	  if (!have_mask || (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &mask)))
+	    cpus.push_back(cpu);
+	if (cpus.size() > 0) node_cpus.push_back(cpus);
+      }
+#endif
+    if (node_cpus.size() == 0) {
+      std::vector<int> cpus;
+      for (int i=0; i < (int) std::thread::hardware_concurrency(); i++)
+	cpus.push_back(i);
+      node_cpus.push_back(cpus);
     }
-  return result;
   }
 
+  // parses lists such as "0-3,8,10-11"
+  static std::vector<int> parse_list(std::string const &list) {
+    std::vector<int> r;
+    std::stringstream ss(list);
+    std::string range;
+    while (std::getline(ss, range, ',')) {
+      size_t dash = range.find('-');
+      try {
+	int lo = std::stoi(range.substr(0, dash));
+	int hi = (dash == std::string::npos) ? lo : std::stoi(range.substr(dash+1));
+	for (int i = lo; i <= hi; i++) r.push_back(i);
+      } catch (std::exception const &) {}
+    }
+    return r;
+  }
 };
 
+// The number of workers a scheduler starts with: NUM_THREADS if set,
+// otherwise the number of hardware threads.
+inline int default_num_workers() {
+  if (const char* env_p = std::getenv("NUM_THREADS"))
+    return std::stoi(env_p);
+  return std::thread::hardware_concurrency();
+}
+
 //thread_local int thread_id;
 
 template <typename Job>
@@ -147,39 +263,118 @@ public:
 
   static thread_local int thread_id;
 
+  // Priority lanes, lane 0 is the highest.  Each worker has a deque
+  // per lane, idle workers pop and steal from higher lanes first, and
+  // a job spawns into the lane it was taken from, so all the forks of
+  // a root job run at its priority.
+  static int const num_lanes = 2;
+  static thread_local int lane;
+
+  // Sets lane for the life of the scope, restoring it on exit even
+  // if a job throws.
+  struct lane_scope {
+    int prev;
+    lane_scope(int l) : prev(lane) { lane = l; }
+    ~lane_scope() { lane = prev; }
+    lane_scope(const lane_scope&) = delete;
+    lane_scope& operator=(const lane_scope&) = delete;
+  };
+
   scheduler() {
     init_num_workers();
-    num_deques = 2*num_threads;
-    deques = new Deque<Job>[num_deques];
-    attempts = new attempt[num_deques];
-    finished_flag = 0;
+    start_workers();
+  }
 
-    // Spawn num_workers many threads on startup
-    spawned_threads = new std::thread[num_threads-1];
-    std::function<bool()> finished = [&] () {  return finished_flag == 1; };
-    thread_id = 0; // thread-local write
-    for (int i=1; i<num_threads; i++) {
-      spawned_threads[i-1] = std::thread([&, i, finished] () {
-        thread_id = i; // thread-local write
-        start(finished);
-      });
+  ~scheduler() {
+    stop_workers();
+  }
+
+  // Push onto local stack, waking a parked worker if there is one.
+  void spawn(Job* job) {
+    int id = worker_id();
+    queued(lane, 1);
+    deque(lane, id).push_bottom(job);
+    count(&worker_stats::forks);
+    trace(ev_fork);
+    // pairs with fetch_add in park(), so either we see the parked
+    // worker or it sees the job
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (num_parked.load(std::memory_order_relaxed) > 0) wake_one();
+  }
+
+  // Push n jobs at once, jobs[0] is popped first.
+  void spawn_n(Job* jobs, size_t n) {
+    int id = worker_id();
+    queued(lane, n);
+    deque(lane, id).push_bottom_n(jobs, n);
+    count(&worker_stats::forks, n);
+    trace(ev_fork);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    for (size_t i=0; i < n && num_parked.load(std::memory_order_relaxed) > 0; i++)
+      wake_one();
+  }
+
+  // Add to a shared FIFO queue of jobs, waking a parked worker if
+  // there is one.  Used for jobs that are not nested fork-join (e.g.
+  // futures), since these cannot go on the local stack.  Only workers
+  // with nothing on their stack take jobs from it, so a job from it
+  // never runs above (and waits on) a frame that is waiting on it.
+  void submit(Job* job) { submit(job, lane); }
+
+  void submit(Job* job, int job_lane) {
+    if (job_lane < 0 || job_lane >= num_lanes)
+      throw std::invalid_argument("no such priority lane");
+    {
+      std::lock_guard<std::mutex> lock(shared_mutex);
+      shared_jobs[job_lane].push_back(job);
+      num_shared++; // seq_cst, pairs with fetch_add in park()
     }
+    if (num_parked.load() > 0) wake_one();
   }
 
-  ~scheduler() {
-    finished_flag = 1;
-    for (int i=1; i<num_threads; i++) {
-      spawned_threads[i-1].join();
+  // Removes job from the shared queue, returning false if a worker
+  // has already taken it.  Lets a thread waiting for the job run it
+  // itself.
+  bool withdraw(Job* job) {
+    if (num_shared.load() == 0) return false;
+    std::lock_guard<std::mutex> lock(shared_mutex);
+    for (auto& q : shared_jobs) {
+      auto it = std::find(q.begin(), q.end(), job);
+      if (it != q.end()) {
+	q.erase(it);
+	num_shared--;
+	return true;
+      }
     }
-    delete[] spawned_threads;
-    delete[] deques;
-    delete[] attempts;
+    return false;
   }
 
-  // Push onto local stack.
-  void spawn(Job* job) {
+  // Runs jobs for which belongs(job) holds, taken from the top of any
+  // deque, until finished().  For waiting on a job that has started on
+  // another worker: the thread helps with the jobs it forked (see
+  // fork_join_scheduler::Job::root_job), but runs nothing else, since
+  // other jobs could wait on a frame below the wait.
+  template <typename P, typename F>
+  void help(P belongs, F finished) {
     int id = worker_id();
-    deques[id].push_bottom(job);
+    while (!finished()) {
+      Job* job = NULL;
+      int job_lane = 0;
+      for (; job_lane < num_lanes; job_lane++) {
+	for (int i = 0; i < num_deques && !job; i++)
+	  job = deque(job_lane, (id + i) % num_deques).pop_top_if(belongs);
+	if (job) break;
+      }
+      if (!job) {
+	std::this_thread::yield();
+	continue;
+      }
+      queued(job_lane, -1);
+      count(&worker_stats::steals);
+      trace(ev_steal);
+      lane_scope in_lane(job_lane);
+      (*job)();
+    }
   }
 
   // Wait for condition: finished().
@@ -193,23 +388,31 @@ public:
     // If not conservative, schedule within the wait.
     // Can deadlock if a stolen job uses same lock as encloses the wait.
     else start(finished);
+    trace(ev_join);
   }
 
   // All scheduler threads quit after this is called.
-  void finish() {finished_flag = 1;}
+  void finish() {
+    std::lock_guard<std::mutex> lock(park_mutex);
+    finished_flag = 1;
+    park_cv.notify_all();
+  }
+
+  // Is the local stack empty.
+  bool local_empty() {
+    return deque(lane, worker_id()).empty();
+  }
 
   // Pop from local stack.
   Job* try_pop() {
     int id = worker_id();
-    return deques[id].pop_bottom();
+    Job* job = deque(lane, id).pop_bottom();
+    if (job) queued(lane, -1);
+    return job;
   }
 
   void init_num_workers() {
-    if (const char* env_p = std::getenv("NUM_THREADS")) {
-      num_threads = std::stoi(env_p);
-    } else {
-      num_threads = std::thread::hardware_concurrency();
-    }
+    num_threads = default_num_workers();
   }
 
   int num_workers() {
@@ -218,8 +421,91 @@ public:
   int worker_id() {
     return thread_id;
   }
-  void set_num_workers(int) {
-    std::cout << "Unsupported" << std::endl; exit(-1);
+
+  // The NUMA node the worker is pinned to.  Always 0 unless
+  // PIN_THREADS is set, since an unpinned thread can be on any node.
+  int worker_node() {
+    return node_of[thread_id];
+  }
+  int num_nodes() {
+    return (int) node_workers.size();
+  }
+
+  // Stops all workers and restarts with n of them.
+  // Must be called by worker 0 when no jobs are running.
+  void set_num_workers(int n) {
+    if (n < 1)
+      throw std::invalid_argument("number of workers must be at least 1");
+    if (worker_id() != 0)
+      throw std::runtime_error("set_num_workers must be called by worker 0");
+    if (n == num_threads) return;
+    stop_workers();
+    num_threads = n;
+    start_workers();
+  }
+
+  // Prints per worker counters.  Only collected if compiled
+  // with -DSCHEDULER_STATS.
+  void print_stats(std::ostream& os = std::cout) {
+#if defined(SCHEDULER_STATS)
+    os << "worker   jobs  forks  steals  failed  idle(ms)  sleep(ms)  max deque"
+       << std::endl;
+    for (int i=0; i < num_threads; i++) {
+      worker_stats const &st = stats[i];
+      os << std::setw(6) << i << std::setw(7) << st.jobs
+	 << std::setw(7) << st.forks << std::setw(8) << st.steals
+	 << std::setw(8) << st.failed_steals
+	 << std::setw(10) << st.idle_ns / 1000000
+	 << std::setw(11) << st.sleep_ns / 1000000
+	 << std::setw(11) << max_high_water(i) << std::endl;
+    }
+#else
+    os << "scheduler stats not collected, compile with -DSCHEDULER_STATS"
+       << std::endl;
+#endif
+  }
+
+  // Writes the events recorded so far in the Chrome trace event format
+  // (load with chrome://tracing or ui.perfetto.dev).  Fork, steal and
+  // join are instant events, and each worker shows when it runs a
+  // job it got from the scheduler and when it is idle.  Only recorded
+  // if compiled with -DSCHEDULER_TRACE.
+  void write_trace(std::string const &filename) {
+#if defined(SCHEDULER_TRACE)
+    static const char* names[] = {"fork", "steal", "join", "job", "job", "idle", "idle"};
+    static const char phases[] = {'i', 'i', 'i', 'B', 'E', 'B', 'E'};
+    std::ofstream out(filename);
+    out << "{\"traceEvents\":[";
+    bool first = true;
+    out << std::fixed << std::setprecision(3);
+    for (int i=0; i < num_threads; i++)
+      for (trace_event const &e : traces[i]) {
+	out << (first ? "\n" : ",\n");
+	first = false;
+	out << "{\"name\":\"" << names[e.type] << "\",\"ph\":\""
+	    << phases[e.type] << "\",\"ts\":" << e.time / 1000.0
+	    << ",\"pid\":0,\"tid\":" << i;
+	if (phases[e.type] == 'i') out << ",\"s\":\"t\"";
+	if (e.type == ev_steal) out << ",\"args\":{\"victim\":" << e.arg << "}";
+	out << "}";
+      }
+    out << "\n]}" << std::endl;
+#else
+    std::cout << "scheduler trace not recorded, compile with -DSCHEDULER_TRACE"
+	      << " (not writing " << filename << ")" << std::endl;
+#endif
+  }
+
+  void reset_stats() {
+#if defined(SCHEDULER_STATS)
+    for (int i=0; i < num_threads; i++) {
+      stats[i] = worker_stats();
+      for (int l=0; l < num_lanes; l++) deque(l, i).high_water = 0;
+    }
+#endif
+#if defined(SCHEDULER_TRACE)
+    for (int i=0; i < num_threads; i++) traces[i].clear();
+#endif
   }
 
 private:
@@ -227,45 +513,360 @@ private:
   // Align to avoid false sharing.
   struct alignas(128) attempt { size_t val; };
 
-  int num_deques;
-  Deque<Job>* deques;
+  struct alignas(128) worker_stats {
+    size_t jobs = 0;   // jobs run after getting them from the scheduler
+    size_t forks = 0;
+    size_t steals = 0;
+    size_t failed_steals = 0;
+    size_t idle_ns = 0;  // looking for work, including sleeping
+    size_t sleep_ns = 0; // sleeping or parked
+  };
+
+  enum event_type : uint8_t {
+    ev_fork, ev_steal, ev_join, ev_job_begin, ev_job_end,
+    ev_idle_begin, ev_idle_end};
+
+  struct trace_event {
+    uint64_t time; // ns since the workers started
+    uint32_t arg;  // victim for steals
+    event_type type;
+  };
+
+  // no more events are recorded on a worker once this many are
+  static size_t const max_trace_events = (1 << 22);
+
+#if defined(SCHEDULER_STATS)
+  worker_stats* stats;
+#endif
+#if defined(SCHEDULER_TRACE)
+  std::vector<trace_event>* traces;
+#endif
+  std::chrono::steady_clock::time_point start_time;
+
+  uint64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+	     std::chrono::steady_clock::now() - start_time).count();
+  }
+
+  // these compile to nothing unless stats or tracing are enabled
+  void count([[maybe_unused]] size_t worker_stats::* field,
+	     [[maybe_unused]] size_t v = 1) {
+#if defined(SCHEDULER_STATS)
+    stats[worker_id()].*field += v;
+#endif
+  }
+
+  void trace([[maybe_unused]] event_type type,
+	     [[maybe_unused]] uint32_t arg = 0) {
+#if defined(SCHEDULER_TRACE)
+    std::vector<trace_event>& t = traces[worker_id()];
+    if (t.size() < max_trace_events)
+      t.push_back(trace_event{now_ns(), arg, type});
+#endif
+  }
+
+  int num_deques;     // per lane
+  Deque<Job>* deques; // num_lanes * num_deques of them
+  Deque<Job>& deque(int l, int id) { return deques[l * num_deques + id]; }
+
+#if defined(SCHEDULER_STATS)
+  int64_t max_high_water(int id) {
+    int64_t r = 0;
+    for (int l=0; l < num_lanes; l++)
+      r = std::max(r, (int64_t) deque(l, id).high_water);
+    return r;
+  }
+#endif
+
   attempt* attempts;
   std::thread* spawned_threads;
-  int finished_flag;
+  std::atomic<int> finished_flag;
+
+  // Placement of workers, see place_workers()
+  numa_topology topology;
+  std::vector<int> cpu_of;  // -1 if not pinned
+  std::vector<int> node_of;
+  std::vector<std::vector<int>> node_workers;
+
+  // Number of jobs in the deques of each lane, only kept for the
+  // lanes above the lowest, so the common case adds no atomics.
+  std::atomic<long> num_queued[num_lanes];
+
+  void queued(int l, long n) {
+    if (l < num_lanes - 1) num_queued[l].fetch_add(n);
+  }
+
+  std::deque<Job*> shared_jobs[num_lanes]; // see submit()
+  std::atomic<size_t> num_shared{0};
+  std::mutex shared_mutex;
+
+  // Idle workers steal in rounds, sleeping between rounds for
+  // exponentially longer, and park after park_rounds rounds.  Sleeping
+  // is parking with a timeout, so a spawn wakes sleeping workers too.
+  // Workers waiting on a join just sleep briefly between rounds, off
+  // the park lock, so num_parked only counts workers on park_cv.
+  static int const park_rounds = 8;
+  static size_t const local_sweeps = 4;
+  std::atomic<int> num_parked{0};
+  int wakeups = 0; // protected by park_mutex
+  std::mutex park_mutex;
+  std::condition_variable park_cv;
+
+  // If the environment variable PIN_THREADS is set (and not 0),
+  // workers are pinned to cpus filling one NUMA node before moving
+  // to the next.  Otherwise all workers are treated as on node 0.
+  void place_workers() {
+    const char* env_p = std::getenv("PIN_THREADS");
+    bool pin = env_p && std::string(env_p) != "0";
+    cpu_of.assign(num_threads, -1);
+    node_of.assign(num_threads, 0);
+    node_workers.clear();
+    if (!pin) {
+      node_workers.resize(1);
+      for (int i=0; i < num_threads; i++) node_workers[0].push_back(i);
+      return;
+    }
+    std::vector<std::pair<int,int>> slots; // (node, cpu)
+    for (size_t node=0; node < topology.node_cpus.size(); node++)
+      for (int cpu : topology.node_cpus[node])
+	slots.push_back(std::make_pair((int) node, cpu));
+    node_workers.resize(topology.node_cpus.size());
+    for (int i=0; i < num_threads; i++) {
+      auto slot = slots[i % slots.size()];
+      node_of[i] = slot.first;
+      cpu_of[i] = slot.second;
+      node_workers[slot.first].push_back(i);
+    }
+    // drop nodes with no workers, renumbering the rest
+    std::vector<std::vector<int>> used;
+    for (auto& w : node_workers)
+      if (w.size() > 0) {
+	for (int i : w) node_of[i] = (int) used.size();
+	used.push_back(w);
+      }
+    node_workers = used;
+  }
+
+  void pin_thread(int cpu) {
+#if defined(__linux__)
+    if (cpu < 0 || cpu >= CPU_SETSIZE) return;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    sched_setaffinity(0, sizeof(set), &set); // failure leaves it unpinned
+#endif
+  }
+
+  // Spawn num_threads-1 threads, the calling thread is worker 0.
+  void start_workers() {
+    place_workers();
+    num_deques = 2*num_threads;
+    deques = new Deque<Job>[num_lanes * num_deques];
+    for (auto& q : num_queued) q = 0;
+    attempts = new attempt[num_deques];
+    finished_flag = 0;
+    start_time = std::chrono::steady_clock::now();
+#if defined(SCHEDULER_STATS)
+    stats = new worker_stats[num_threads];
+#endif
+#if defined(SCHEDULER_TRACE)
+    traces = new std::vector<trace_event>[num_threads];
+#endif
+
+    spawned_threads = new std::thread[num_threads-1];
+    std::function<bool()> finished = [&] () {  return finished_flag == 1; };
+    thread_id = 0; // thread-local write
+    pin_thread(cpu_of[0]);
+    for (int i=1; i<num_threads; i++) {
+      spawned_threads[i-1] = std::thread([&, i, finished] () {
+        thread_id = i; // thread-local write
+        pin_thread(cpu_of[i]);
+        start(finished, true);
+      });
+    }
+  }
+
+  void stop_workers() {
+    finish();
+    for (int i=1; i<num_threads; i++) {
+      spawned_threads[i-1].join();
+    }
+    delete[] spawned_threads;
+    delete[] deques;
+    delete[] attempts;
+#if defined(SCHEDULER_STATS)
+    delete[] stats;
+#endif
+#if defined(SCHEDULER_TRACE)
+    delete[] traces;
+#endif
+  }
 
   // Start an individual scheduler task.  Runs until finished().
+  // Only top level workers can park, since a worker waiting on a join
+  // is not woken when the joined job finishes.
   template <typename F>
-  void start(F finished) {
+  void start(F finished, bool can_park=false) {
     while (1) {
-      Job* job = get_job(finished);
+      int job_lane;
+      Job* job = get_job(finished, can_park, job_lane);
       if (!job) return;
+      count(&worker_stats::jobs);
+      trace(ev_job_begin);
+      lane_scope in_lane(job_lane);
       (*job)();
+      trace(ev_job_end);
     }
   }
 
-  Job* try_steal(size_t id) {
-    // use hashing to get "random" target
-    size_t target = (hash(id) + hash(attempts[id].val)) % num_deques;
+  // uses hashing to get a "random" number
+  size_t random(size_t id) {
+    size_t r = hash(id) + hash(attempts[id].val);
     attempts[id].val++;
-    return deques[target].pop_top();
+    return r;
+  }
+
+  // For each lane in order, tries the shared queue (if shared) and
+  // then the deque of target.  Stops before a lower lane while jobs of
+  // a higher lane are queued in any deque, so high priority work on
+  // all victims is stolen first.
+  Job* try_steal(size_t target, bool shared, int& job_lane) {
+    for (job_lane = 0; job_lane < num_lanes; job_lane++) {
+      Job* job = shared ? try_pop_shared(job_lane) : NULL;
+      if (job) return job;
+      job = deque(job_lane, target).pop_top();
+      if (job) {
+	queued(job_lane, -1);
+	count(&worker_stats::steals);
+	trace(ev_steal, (uint32_t) target);
+	return job;
+      }
+      // a job of this lane is on another victim, so take it before
+      // any lower lane job
+      if (job_lane < num_lanes - 1 && num_queued[job_lane].load() > 0) break;
+    }
+    count(&worker_stats::failed_steals);
+    return NULL;
+  }
+
+  Job* try_pop_shared(int l) {
+    if (num_shared.load(std::memory_order_relaxed) == 0) return NULL;
+    std::lock_guard<std::mutex> lock(shared_mutex);
+    if (shared_jobs[l].empty()) return NULL;
+    Job* job = shared_jobs[l].front();
+    shared_jobs[l].pop_front();
+    num_shared--;
+    return job;
+  }
+
+  bool work_available() {
+    if (num_shared.load() > 0) return true;
+    for (int i=0; i < num_lanes * num_deques; i++)
+      if (!deques[i].empty()) return true;
+    return false;
+  }
+
+  // Sleep until a spawn or finish() wakes us up, or timeout passes
+  // if it is not zero.
+  template <typename F>
+  void park(F finished,
+	    std::chrono::nanoseconds timeout = std::chrono::nanoseconds(0)) {
+    std::unique_lock<std::mutex> lock(park_mutex);
+    num_parked.fetch_add(1); // seq_cst, pairs with fence in spawn()
+    if (work_available() || finished()) {
+      num_parked--;
+      return;
+    }
+    auto woken = [&] () {return wakeups > 0 || finished_flag == 1;};
+    if (timeout.count() > 0) park_cv.wait_for(lock, timeout, woken);
+    else park_cv.wait(lock, woken);
+    if (wakeups > 0) wakeups--; // waker already decremented num_parked
+    else num_parked--;
+  }
+
+  void wake_one() {
+    std::lock_guard<std::mutex> lock(park_mutex);
+    if (num_parked.load() > 0) {
+      num_parked--;
+      wakeups++;
+      park_cv.notify_one();
+    }
   }
 
-  // Find a job, first trying local stack, then random steals.
+  // Find a job, first trying local stacks, then the shared queues,
+  // then random steals, in each case by lane.  Sets job_lane to the
+  // lane the job came from.  Only top level workers (can_park) take
+  // from the shared queues, see submit().
   template <typename F>
-  Job* get_job(F finished) {
+  Job* get_job(F finished, bool can_park, int& job_lane) {
     if (finished()) return NULL;
-    Job* job = try_pop();
-    if (job) return job;
+    int id = worker_id();
+    Job* job;
+    for (job_lane = 0; job_lane < num_lanes; job_lane++)
+      if ((job = deque(job_lane, id).pop_bottom())) {
+	queued(job_lane, -1);
+	return job;
+      }
+    if (can_park)
+      for (job_lane = 0; job_lane < num_lanes; job_lane++)
+	if ((job = try_pop_shared(job_lane))) return job;
+#if defined(SCHEDULER_STATS)
+    uint64_t idle_start = now_ns();
+#endif
+    trace(ev_idle_begin);
+    job = steal_job(finished, can_park, job_lane);
+    trace(ev_idle_end);
+#if defined(SCHEDULER_STATS)
+    count(&worker_stats::idle_ns, now_ns() - idle_start);
+#endif
+    return job;
+  }
+
+  // Steal until we get a job or finished().
+  template <typename F>
+  Job* steal_job(F finished, bool can_park, int& job_lane) {
+    Job* job;
     size_t id = worker_id();
+    int round = 0;
+    // each round first tries every victim on our own node, local_sweeps
+    // times starting at a random one, so the node is drained before
+    // stealing from other nodes
+    std::vector<int> const* local = NULL;
+    if (num_nodes() > 1 && node_workers[node_of[id]].size() > 1)
+      local = &node_workers[node_of[id]];
     while (1) {
+      if (local) {
+	size_t k = local->size();
+	size_t start = random(id);
+	for (size_t i=0; i < local_sweeps * k; i++) {
+	  if (finished()) return NULL;
+	  job = try_steal((*local)[(start + i) % k], can_park, job_lane);
+	  if (job) return job;
+	}
+      }
       // By coupon collector's problem, this should touch all.
       for (int i=0; i <= num_deques * 100; i++) {
 	if (finished()) return NULL;
-	job = try_steal(id);
+	job = try_steal(random(id) % num_deques, can_park, job_lane);
 	if (job) return job;
       }
-      // If haven't found anything, take a breather.
-      std::this_thread::sleep_for(std::chrono::nanoseconds(num_deques*100));
+      // If haven't found anything, take a breather, or park if we
+      // have been idle for a while.
+#if defined(SCHEDULER_STATS)
+      uint64_t sleep_start = now_ns();
+#endif
+      if (!can_park)
+	std::this_thread::sleep_for(std::chrono::nanoseconds(num_deques*100));
+      else if (round == park_rounds) {
+	park(finished);
+	round = 0;
+      } else {
+	park(finished, std::chrono::nanoseconds(num_deques*100 << round));
+	round++;
+      }
+#if defined(SCHEDULER_STATS)
+      count(&worker_stats::sleep_ns, now_ns() - sleep_start);
+#endif
     }
   }
 
@@ -280,17 +881,71 @@ private:
 template<typename T>
 thread_local int scheduler<T>::thread_id = 0;
 
+template<typename T>
+thread_local int scheduler<T>::lane = scheduler<T>::num_lanes - 1;
+
 struct fork_join_scheduler {
 
 public:
   // Jobs are thunks -- i.e., functions that take no arguments
   // and return nothing.   Could be a lambda, e.g. [] () {}.
-  using Job = std::function<void()>;
+  // A Job only holds a function pointer, a pointer to the thunk, and
+  // a done flag.  It lives on the stack of the forking thread, so
+  // unlike std::function a fork never allocates.  Jobs of a k-way
+  // fork (pardo_n) instead decrement a shared join counter, which is
+  // their last access to the forking thread's stack.
+  // A job also records its root, the job whose work it is part of: a
+  // root job (e.g. of a future) is its own root, and other jobs have
+  // the root of the job that was running when they were forked.
+  struct Job {
+    struct root_tag {};
+
+    template <typename F>
+    explicit Job(F& f, std::atomic<size_t>* join = nullptr)
+      : run(&invoke<F>), thunk(&f), join(join), root(running_root),
+	done(false) {}
+
+    template <typename F>
+    Job(F& f, root_tag)
+      : run(&invoke<F>), thunk(&f), join(nullptr), root(this), done(false) {}
+
+    void operator()() {
+      Job* saved_root = running_root;
+      running_root = root;
+      run(thunk);
+      running_root = saved_root;
+      if (join) join->fetch_sub(1, std::memory_order_release);
+      else done.store(true, std::memory_order_release);
+    }
+
+    bool finished() { return done.load(std::memory_order_acquire); }
+
+    Job* root_job() { return root; }
+
+  private:
+    template <typename F>
+    static void invoke(void* f) { (*static_cast<F*>(f))(); }
+
+    static inline thread_local Job* running_root = nullptr;
+
+    void (*run)(void*);
+    void* thunk;
+    std::atomic<size_t>* join;
+    Job* root;
+    std::atomic<bool> done;
+  };
 
   scheduler<Job>* sched;
 
+  // If true, parfor uses lazy binary splitting (see parfor_lazy)
+  // instead of estimating a granularity.  Set by the environment
+  // variable LAZY_SPLITTING, or directly.
+  bool lazy_splitting;
+
   fork_join_scheduler() {
     sched = new scheduler<Job>;
+    const char* env_p = std::getenv("LAZY_SPLITTING");
+    lazy_splitting = env_p && std::string(env_p) != "0";
   }
 
   ~fork_join_scheduler() {
@@ -310,23 +965,56 @@ public:
 
   int num_workers() { return sched->num_workers(); }
   int worker_id() { return sched->worker_id(); }
+  int worker_node() { return sched->worker_node(); }
+  int num_nodes() { return sched->num_nodes(); }
   void set_num_workers(int n) { sched->set_num_workers(n); }
+  void print_stats(std::ostream& os = std::cout) { sched->print_stats(os); }
+  void write_trace(std::string const &filename) { sched->write_trace(filename); }
+  void reset_stats() { sched->reset_stats(); }
+
+  // Runs f() with everything it forks in priority lane p (0 is the
+  // highest, see scheduler::num_lanes).
+  template <typename F>
+  void run_at_priority(int p, F f) {
+    if (p < 0 || p >= scheduler<Job>::num_lanes)
+      throw std::invalid_argument("no such priority lane");
+    scheduler<Job>::lane_scope in_lane(p);
+    f();
+  }
 
   // Fork two thunks and wait until they both finish.
   template <typename L, typename R>
   void pardo(L left, R right, bool conservative=false) {
-    bool right_done = false;
-    Job right_job = [&] () {
-      right(); right_done = true;};
+    Job right_job(right);
     sched->spawn(&right_job);
     left();
-    if (sched->try_pop() != NULL) right();
+    Job* job = sched->try_pop();
+    if (job == &right_job) right();
     else {
-      auto finished = [&] () {return right_done;};
+      // right_job was stolen, and the thieves took the older jobs first
+      assert(job == NULL);
+      auto finished = [&] () {return right_job.finished();};
       sched->wait(finished, conservative);
     }
   }
 
+  // Fork f(start), ..., f(end-1) and wait until they all finish.
+  // Up to max_fork jobs are pushed at once and share one join counter,
+  // so wide forks (e.g. over buckets) avoid a tree of pardos.  Wider
+  // ranges are forked as max_fork blocks, each of which forks again.
+  template <typename F>
+  void pardo_n(size_t start, size_t end, F& f, bool conservative=false) {
+    size_t k = end - start;
+    if (k <= max_fork) pardo_fan(start, k, f, conservative);
+    else {
+      size_t block = (k + max_fork - 1) / max_fork;
+      auto g = [&] (size_t i) {
+	size_t s = start + i * block;
+	pardo_n(s, std::min(s + block, end), f, conservative);};
+      pardo_fan(0, (k + block - 1) / block, g, conservative);
+    }
+  }
+
   template <typename F>
   int get_granularity(size_t start, size_t end, F f) {
     size_t done = 0;
@@ -344,35 +1032,134 @@ public:
     return done;
   }
 
+  // If cancel is given, once it is set no more jobs are forked and
+  // each running block stops before its next iteration.
   template <typename F>
   void parfor(size_t start, size_t end, F f,
 	      size_t granularity = 0,
-	      bool conservative = false) {
+	      bool conservative = false,
+	      std::atomic<bool> const* cancel = nullptr) {
     if (end <= start) return;
-    if (granularity == 0) {
-      size_t done = get_granularity(start,end, f);
+    if (lazy_splitting)
+      parfor_lazy(start, end, f,
+		  (granularity == 0) ? lazy_chunk : granularity,
+		  conservative, cancel);
+    else if (granularity == 0) {
+      auto g = [&] (size_t i) {if (!cancelled(cancel)) f(i);};
+      size_t done = get_granularity(start,end, g);
       granularity = std::max(done, (end-start)/(128*sched->num_threads));
-      parfor_(start+done, end, f, granularity, conservative);
-    } else parfor_(start, end, f, granularity, conservative);
+      parfor_(start+done, end, f, granularity, conservative, cancel);
+    } else parfor_(start, end, f, granularity, conservative, cancel);
   }
 
 private:
 
+  static constexpr size_t max_fork = 32;
+
+  template <typename F>
+  struct fork_child {
+    F* f;
+    size_t i;
+    void operator()() { (*f)(i); }
+  };
+
+  // Requires k <= max_fork.  Runs f(start) here, then pops and runs
+  // the other jobs until the deque runs dry (the rest were stolen).
+  template <typename F>
+  void pardo_fan(size_t start, size_t k, F& f, bool conservative) {
+    if (k == 0) return;
+    if (k == 1) { f(start); return; }
+    std::atomic<size_t> join(k - 1);
+    fork_child<F> children[max_fork];
+    alignas(Job) unsigned char space[max_fork * sizeof(Job)];
+    Job* jobs = reinterpret_cast<Job*>(space);
+    for (size_t i = 1; i < k; i++) {
+      children[i] = fork_child<F>{&f, start + i};
+      new (&jobs[i]) Job(children[i], &join);
+    }
+    sched->spawn_n(jobs + 1, k - 1);
+    f(start);
+    for (size_t i = 1; i < k; i++) {
+      Job* job = sched->try_pop();
+      if (job == NULL) break;
+      assert(job >= jobs + 1 && job < jobs + k); // see pardo
+      (*job)();
+    }
+    auto finished = [&] () {return join.load(std::memory_order_acquire) == 0;};
+    if (!finished()) sched->wait(finished, conservative);
+  }
+
+  static constexpr size_t lazy_chunk = 128;
+  static constexpr long heartbeat_ns = 100000;
+  static inline thread_local std::chrono::steady_clock::time_point last_split;
+
+  // True if heartbeat_ns has passed since the last split on this worker.
+  bool heartbeat() {
+    auto now = std::chrono::steady_clock::now();
+    if (now - last_split < std::chrono::nanoseconds(heartbeat_ns))
+      return false;
+    last_split = now;
+    return true;
+  }
+
+  // Lazy binary splitting (Tzannes, Caragea, Barua and Vishkin,
+  // PPoPP 2010) with a heartbeat (Acar, Chargueraud, Guatto, Rainey
+  // and Sieczkowski, PLDI 2018).  Runs chunk iterations at a time,
+  // and only splits the rest of the range in half when the local
+  // deque is empty (a thief has taken our work, so there is likely
+  // demand) or a heartbeat has passed.
+  template <typename F>
+  void parfor_lazy(size_t start, size_t end, F f,
+		   size_t chunk,
+		   bool conservative,
+		   std::atomic<bool> const* cancel = nullptr) {
+    while (end - start > chunk) {
+      if (cancelled(cancel)) return;
+      if (sched->local_empty() || heartbeat()) {
+	size_t mid = start + (end - start)/2;
+	pardo([&] () {parfor_lazy(start, mid, f, chunk, conservative, cancel);},
+	      [&] () {parfor_lazy(mid, end, f, chunk, conservative, cancel);},
+	      conservative);
+	return;
+      }
+      run_range(start, start + chunk, f, cancel);
+      start += chunk;
+    }
+    run_range(start, end, f, cancel);
+  }
+
   template <typename F>
   void parfor_(size_t start, size_t end, F f,
 	       size_t granularity,
-	       bool conservative) {
+	       bool conservative,
+	       std::atomic<bool> const* cancel = nullptr) {
+    if (cancelled(cancel)) return;
     if ((end - start) <= granularity)
-      for (size_t i=start; i < end; i++) f(i);
+      run_range(start, end, f, cancel);
     else {
       size_t n = end-start;
       // Not in middle to avoid clashes on set-associative caches
       // on powers of 2.
       size_t mid = (start + (9*(n+1))/16);
-      pardo([&] () {parfor_(start, mid, f, granularity, conservative);},
-	    [&] () {parfor_(mid, end, f, granularity, conservative);},
+      pardo([&] () {parfor_(start, mid, f, granularity, conservative, cancel);},
+	    [&] () {parfor_(mid, end, f, granularity, conservative, cancel);},
 	    conservative);
     }
   }
 
+  static bool cancelled(std::atomic<bool> const* cancel) {
+    return cancel && cancel->load(std::memory_order_relaxed);
+  }
+
+  template <typename F>
+  static void run_range(size_t start, size_t end, F& f,
+			std::atomic<bool> const* cancel) {
+    if (cancel) {
+      for (size_t i=start; i < end; i++) {
+	if (cancel->load(std::memory_order_relaxed)) return;
+	f(i);
+      }
+    } else for (size_t i=start; i < end; i++) f(i);
+  }
+
 };
@@ -185,8 +185,8 @@ namespace pbbs {
 
     // uninitialized sequence of length sz
     // dangerous if non primitive types and not immediately initialized
-    static sequence<value_type> no_init(const size_t sz) {
-      sequence<value_type> r;
+    static sequence no_init(const size_t sz) {
+      sequence r;
       r.alloc_no_init(sz);
       return r;
     };
@@ -22,7 +22,10 @@
 
 #pragma once
 
+#include <cstdint>
 #include <iostream>
+#include <thread>
+#include <type_traits>
 #include "utilities.h"
 #include "seq.h"
 #include "monoid.h"
@@ -40,12 +43,18 @@ namespace pbbs {
   // delayed version of map
   // requires C++14 or greater, both since return type is not defined (a lambda)
   //   and for support of initialization of the closure lambda capture
+  // An lvalue A is kept by reference (copying it would materialize it
+  // again), and an rvalue is moved in.
   template <SEQ Seq, class UnaryFunc>
   auto dmap(Seq &&A, UnaryFunc&& f) {
     size_t n = A.size();
-    return dseq(n, [f=std::forward<UnaryFunc>(f),
-		    A=std::forward<Seq>(A)] (size_t i) {
-		  return f(A[i]);});}
+    if constexpr (std::is_lvalue_reference<Seq>::value)
+      return dseq(n, [f=std::forward<UnaryFunc>(f), &A] (size_t i) {
+	  return f(A[i]);});
+    else
+      return dseq(n, [f=std::forward<UnaryFunc>(f),
+		      A=std::forward<Seq>(A)] (size_t i) {
+		    return f(A[i]);});}
 
   template <class T>
   auto singleton(T const &v) -> sequence<T> {
@@ -126,6 +135,79 @@ namespace pbbs {
     return r;
   }
 
+  // Forces the single pass scan (scan_single_pass) or the two pass
+  // scan.  Without either the single pass one is used for large n if
+  // the values are exact_scan.
+  const flags fl_scan_single_pass = (1 << 5);
+  const flags fl_scan_two_pass = (1 << 6);
+  constexpr const size_t _scan_single_pass_min = (1 << 16);
+
+  // Whether a scan over T gives the same result however its values are
+  // grouped.  The single pass scan groups them depending on timing, so
+  // e.g. floating point sums could differ from run to run.  True for
+  // integers, and can be specialized for other exact types.
+  template <class T>
+  struct exact_scan : std::is_integral<T> {};
+
+  // A scan in a single pass over the input, using decoupled look-back
+  // (Merrill and Garland).  The blocks are claimed in order from a
+  // counter.  A block is reduced, publishes its sum, and then looks back
+  // over the blocks before it, adding their sums until it reaches one
+  // that has published its inclusive prefix.  It publishes its own
+  // inclusive prefix and then scans the block, which is still in cache,
+  // so In is read from memory once instead of twice.  A block only waits
+  // on earlier blocks, which have all been claimed by running workers,
+  // so it cannot deadlock.
+  template <SEQ In_Seq, RANGE Out_Range, class Monoid>
+  auto scan_single_pass(In_Seq const &In, Out_Range Out, Monoid const &m,
+			flags fl = no_flag) -> typename In_Seq::value_type
+  {
+    using T = typename In_Seq::value_type;
+    enum {empty, aggregate, inclusive};
+    size_t n = In.size();
+    size_t l = num_blocks(n,_block_size);
+    sequence<int> Status(l, (int) empty);
+    sequence<T> Sums(l);
+    sequence<T> Prefixes(l);
+    std::atomic<size_t> next(0);
+
+    auto wait_for = [&] (size_t j) {
+      int status;
+      for (size_t k = 0;
+	   (status = __atomic_load_n(&Status[j], __ATOMIC_ACQUIRE)) == empty;
+	   k++)
+	if (k >= 64) std::this_thread::yield(); // its worker was descheduled
+      return status;
+    };
+
+    auto do_block = [&] (size_t i) {
+      size_t s = i * _block_size;
+      size_t e = std::min(s + _block_size, n);
+      T r = reduce_serial(In.slice(s,e), m);
+      T offset = m.identity;
+      if (i > 0) {
+	Sums[i] = r;
+	__atomic_store_n(&Status[i], (int) aggregate, __ATOMIC_RELEASE);
+	T sum = m.identity; // of blocks j+1 to i-1
+	for (size_t j = i-1; ; j--) {
+	  if (wait_for(j) == inclusive) {
+	    offset = m.f(Prefixes[j], sum);
+	    break;
+	  }
+	  sum = m.f(Sums[j], sum);
+	}
+      }
+      Prefixes[i] = m.f(offset, r);
+      __atomic_store_n(&Status[i], (int) inclusive, __ATOMIC_RELEASE);
+      scan_serial(In.slice(s,e), Out.slice(s,e), m, offset, fl);
+    };
+
+    parallel_for(0, std::min((size_t) num_workers(), l), [&] (size_t) {
+	size_t i;
+	while ((i = next++) < l) do_block(i);}, 1);
+    return Prefixes[l-1];
+  }
+
   template <SEQ In_Seq, RANGE Out_Range, class Monoid>
   auto scan_(In_Seq const &In, Out_Range Out, Monoid const &m,
 	     flags fl = no_flag) -> typename In_Seq::value_type
@@ -135,6 +217,10 @@ namespace pbbs {
     size_t l = num_blocks(n,_block_size);
     if (l <= 2 || fl & fl_sequential)
       return scan_serial(In, Out, m, m.identity, fl);
+    if ((fl & fl_scan_single_pass) ||
+	(exact_scan<T>::value && n >= _scan_single_pass_min &&
+	 !(fl & fl_scan_two_pass)))
+      return scan_single_pass(In, Out, m, fl);
     sequence<T> Sums(l);
     sliced_for (n, _block_size,
 		[&] (size_t i, size_t s, size_t e)
@@ -241,6 +327,40 @@ namespace pbbs {
     return m;
   }
 
+  // The flags of filter are kept in bits, an eighth of the memory
+  // traffic of a sequence<bool>.  The blocks are a multiple of 64 long,
+  // so each block sets its own words.
+
+  // Sets the bits for In[s,e) and returns how many are set
+  template <SEQ In_Seq, class F>
+  size_t set_filter_bits(In_Seq const &In, F& f, uint64_t* Fl,
+			 size_t s, size_t e) {
+    size_t r = 0;
+    for (size_t w = s; w < e; w += 64) {
+      uint64_t bits = 0;
+      size_t we = std::min(w + 64, e);
+      for (size_t j = w; j < we; j++)
+	if (f(In[j])) bits |= ((uint64_t) 1) << (j - w);
+      Fl[w/64] = bits;
+      r += __builtin_popcountl(bits);
+    }
+    return r;
+  }
+
+  // Copies In[j] for the bits set in [s,e) to Out
+  template <SEQ In_Seq, RANGE Out_Seq>
+  void pack_bits_at(In_Seq const &In, uint64_t const* Fl,
+		    size_t s, size_t e, Out_Seq Out) {
+    size_t k = 0;
+    for (size_t w = s; w < e; w += 64) {
+      uint64_t bits = Fl[w/64];
+      while (bits) {
+	assign_uninitialized(Out[k++], In[w + __builtin_ctzl(bits)]);
+	bits &= bits - 1;
+      }
+    }
+  }
+
   template <SEQ In_Seq, class F>
   auto filter(In_Seq const &In, F f)
     -> sequence<typename In_Seq::value_type>
@@ -249,20 +369,16 @@ namespace pbbs {
     size_t n = In.size();
     size_t l = num_blocks(n,_block_size);
     sequence<size_t> Sums(l);
-    sequence<bool> Fl(n);
+    sequence<uint64_t> Fl = sequence<uint64_t>::no_init(num_blocks(n, 64));
     sliced_for (n, _block_size,
 		[&] (size_t i, size_t s, size_t e)
-		{ size_t r = 0;
-		  for (size_t j=s; j < e; j++)
-		    r += (Fl[j] = f(In[j]));
-		  Sums[i] = r;});
+		{ Sums[i] = set_filter_bits(In, f, Fl.begin(), s, e);});
     size_t m = scan_inplace(Sums.slice(), addm<size_t>());
     sequence<T> Out = sequence<T>::no_init(m);
     sliced_for (n, _block_size,
 		[&] (size_t i, size_t s, size_t e)
-		{ pack_serial_at(In.slice(s,e),
-				 Fl.slice(s,e),
-				 Out.slice(Sums[i], (i == l-1) ? m : Sums[i+1]));});
+		{ pack_bits_at(In, Fl.begin(), s, e,
+			       Out.slice(Sums[i], (i == l-1) ? m : Sums[i+1]));});
     return Out;
   }
 
@@ -276,18 +392,15 @@ namespace pbbs {
     size_t n = In.size();
     size_t l = pbbs::num_blocks(n,_block_size);
     pbbs::sequence<size_t> Sums(l);
-    pbbs::sequence<bool> Fl(n);
+    auto Fl = pbbs::sequence<uint64_t>::no_init(num_blocks(n, 64));
     pbbs::sliced_for (n, pbbs::_block_size,
 		[&] (size_t i, size_t s, size_t e)
-		{ size_t r = 0;
-		  for (size_t j=s; j < e; j++)
-		    r += (Fl[j] = f(In[j]));
-		  Sums[i] = r;});
+		{ Sums[i] = set_filter_bits(In, f, Fl.begin(), s, e);});
     size_t m = scan_inplace(Sums.slice(), addm<size_t>());
     pbbs::sliced_for (n, _block_size,
 		[&] (size_t i, size_t s, size_t e)
-		{ pack_serial_at(In.slice(s,e), Fl.slice(s,e),
-                  Out.slice(Sums[i], (i == l-1) ? m : Sums[i+1]));});
+		{ pack_bits_at(In, Fl.begin(), s, e,
+			       Out.slice(Sums[i], (i == l-1) ? m : Sums[i+1]));});
     return m;
   }
 
@@ -301,6 +414,128 @@ namespace pbbs {
     return pack(delayed_seq<Idx_Type>(Fl.size(),identity), Fl, fl);
   }
 
+  // A delayed filter, the elements of A that satisfy p, for fusing a
+  // filter with what consumes it, e.g.
+  //    reduce(dfilter(dmap(A, f), p), m)
+  // reduces in one pass without writing anything, and to_sequence or
+  // scan counts each block in one pass and writes the output in a
+  // second, without an array of flags (unlike filter).  The second pass
+  // evaluates A[i] and p again, so they should be cheap and have no
+  // side effects; use filter otherwise.  A is kept by reference if an
+  // lvalue, and moved in otherwise.
+  template <class Seq, class Pred>
+  struct delayed_filter {
+    using value_type = typename std::decay_t<Seq>::value_type;
+    Seq A;
+    Pred p;
+  };
+
+  template <SEQ Seq, class Pred>
+  auto dfilter(Seq &&A, Pred p) -> delayed_filter<Seq, Pred> {
+    return delayed_filter<Seq, Pred>{std::forward<Seq>(A), p};
+  }
+
+  template <class Seq, class Pred, class Monoid>
+  auto reduce(delayed_filter<Seq, Pred> const &F, Monoid m, flags fl = no_flag)
+    -> typename delayed_filter<Seq, Pred>::value_type
+  {
+    using T = typename delayed_filter<Seq, Pred>::value_type;
+    auto reduce_block = [&] (size_t s, size_t e) {
+      T r = m.identity;
+      for (size_t j = s; j < e; j++) {
+	T x = F.A[j];
+	if (F.p(x)) r = m.f(r, x);
+      }
+      return r;
+    };
+    size_t n = F.A.size();
+    size_t l = num_blocks(n, _block_size);
+    if (l <= 1 || (fl & fl_sequential)) return reduce_block(0, n);
+    sequence<T> Sums(l);
+    sliced_for (n, _block_size, [&] (size_t i, size_t s, size_t e) {
+	Sums[i] = reduce_block(s, e);});
+    return reduce(Sums, m);
+  }
+
+  template <class Seq, class Pred>
+  size_t count_serial(delayed_filter<Seq, Pred> const &F, size_t s, size_t e) {
+    size_t r = 0;
+    for (size_t j = s; j < e; j++) r += (bool) F.p(F.A[j]);
+    return r;
+  }
+
+  template <class Seq, class Pred>
+  auto to_sequence(delayed_filter<Seq, Pred> const &F)
+    -> sequence<typename delayed_filter<Seq, Pred>::value_type>
+  {
+    using T = typename delayed_filter<Seq, Pred>::value_type;
+    size_t n = F.A.size();
+    size_t l = num_blocks(n, _block_size);
+    sequence<size_t> Sums(l);
+    sliced_for (n, _block_size, [&] (size_t i, size_t s, size_t e) {
+	Sums[i] = count_serial(F, s, e);});
+    size_t m = scan_inplace(Sums.slice(), addm<size_t>());
+    sequence<T> Out = sequence<T>::no_init(m);
+    sliced_for (n, _block_size, [&] (size_t i, size_t s, size_t e) {
+	size_t k = Sums[i];
+	size_t k_end = (i == l-1) ? m : Sums[i+1];
+	if (k_end - k == e - s) // all kept, no need to test
+	  for (size_t j = s; j < e; j++) assign_uninitialized(Out[k++], F.A[j]);
+	else if (std::is_trivially_copyable<T>::value)
+	  // without a branch: writes every element, but only moves past
+	  // the kept ones, stopping after the last one
+	  for (size_t j = s; k < k_end; j++) {
+	    T x = F.A[j];
+	    Out[k] = x;
+	    k += (bool) F.p(x);
+	  }
+	else
+	  for (size_t j = s; k < k_end; j++) {
+	    T x = F.A[j];
+	    if (F.p(x)) assign_uninitialized(Out[k++], x);
+	  }
+      });
+    return Out;
+  }
+
+  template <class Seq, class Pred, class Monoid>
+  auto scan(delayed_filter<Seq, Pred> const &F, Monoid m, flags fl = no_flag)
+    -> std::pair<sequence<typename delayed_filter<Seq, Pred>::value_type>,
+		 typename delayed_filter<Seq, Pred>::value_type>
+  {
+    using T = typename delayed_filter<Seq, Pred>::value_type;
+    size_t n = F.A.size();
+    size_t l = num_blocks(n, _block_size);
+    bool inclusive = fl & fl_scan_inclusive;
+    sequence<size_t> Counts(l);
+    sequence<T> Sums(l);
+    sliced_for (n, _block_size, [&] (size_t i, size_t s, size_t e) {
+	size_t c = 0;
+	T r = m.identity;
+	for (size_t j = s; j < e; j++) {
+	  T x = F.A[j];
+	  if (F.p(x)) {c++; r = m.f(r, x);}
+	}
+	Counts[i] = c; Sums[i] = r;});
+    size_t k_total = scan_inplace(Counts.slice(), addm<size_t>());
+    T total = scan_inplace(Sums.slice(), m);
+    sequence<T> Out = sequence<T>::no_init(k_total);
+    sliced_for (n, _block_size, [&] (size_t i, size_t s, size_t e) {
+	size_t k = Counts[i];
+	if (k == ((i == l-1) ? k_total : Counts[i+1])) return;
+	T r = Sums[i];
+	for (size_t j = s; j < e; j++) {
+	  T x = F.A[j];
+	  if (F.p(x)) {
+	    if (inclusive) r = m.f(r, x);
+	    assign_uninitialized(Out[k++], r);
+	    if (!inclusive) r = m.f(r, x);
+	  }
+	}
+      });
+    return std::make_pair(std::move(Out), total);
+  }
+
   template <SEQ In_Seq, SEQ Char_Seq>
   std::pair<size_t,size_t> split_three(In_Seq const &In,
 				       range<typename In_Seq::value_type*> Out,
@@ -14,6 +14,9 @@ namespace pbbs {
     return r;
   }
 
+  // First i with p(i), or n if none.  Searches blocks of doubling
+  // size so the work is proportional to the answer, and within a
+  // block skips indices past the best found so far.
   template<class IntegerPred>
   size_t find_if_index(size_t n, IntegerPred p, size_t granularity=1000) {
     size_t i;
@@ -26,7 +29,7 @@ namespace pbbs {
     while (start < n) {
       size_t end = std::min(n, start + block_size);
       parallel_for(start, end, [&] (size_t j) {
-	  if (p(j)) write_min(&i, j, std::less<size_t>());
+	  if (j < i && p(j)) write_min(&i, j, std::less<size_t>());
 	}, granularity);
       if (i < n) return i;
       start += block_size;
@@ -35,6 +38,29 @@ namespace pbbs {
     return n;
   }
 
+  // Any i with p(i), or n if none.  As find_if_index, but the search
+  // is cancelled as soon as a match is found.
+  template<class IntegerPred>
+  size_t find_any_index(size_t n, IntegerPred p, size_t granularity=1000) {
+    size_t i;
+    for (i = 0; i < std::min(granularity, n); i++)
+      if (p(i)) return i;
+    if (i == n) return n;
+    size_t start = granularity;
+    size_t block_size = 2 * granularity;
+    std::atomic<size_t> r(n);
+    cancel_token found;
+    while (start < n && !found.cancelled()) {
+      size_t end = std::min(n, start + block_size);
+      parallel_for(start, end, [&] (size_t j) {
+	  if (p(j)) {r = j; found.cancel();}
+	}, found, granularity);
+      start += block_size;
+      block_size *= 2;
+    }
+    return r;
+  }
+
   template<class Seq, class UnaryFunction>
   void for_each(Seq const &S, UnaryFunction f) {
     parallel_for(S.size(), [&] (size_t i) {f(S[i]);});}
@@ -48,13 +74,16 @@ namespace pbbs {
     return count_if_index(S.size(), [&] (size_t i) {return S[i] == value;});}
 
   template<class Seq, class UnaryPred>
-  bool all_of(Seq const &S, UnaryPred p) { return count_if(S, p) == S.size();}
+  bool any_of(Seq const &S, UnaryPred p) {
+    return find_any_index(S.size(), [&] (size_t i) {
+	return p(S[i]);}) < S.size();}
 
   template<class Seq, class UnaryPred>
-  bool any_of(Seq const &S, UnaryPred p) { return count_if(S, p) > 1;}
+  bool all_of(Seq const &S, UnaryPred p) {
+    return !any_of(S, [&] (auto const &x) {return !p(x);});}
 
   template<class Seq, class UnaryPred>
-  bool none_of(Seq const &S, UnaryPred p) { return count_if(S, p) == 0;}
+  bool none_of(Seq const &S, UnaryPred p) { return !any_of(S, p);}
 
   template<class Seq, class UnaryPred>
   size_t find_if(Seq const &S, UnaryPred p) {
@@ -87,7 +116,7 @@ namespace pbbs {
     return find_if_index(S.size()-1, [&] (size_t i) {
 	return S[i] == S[i+1];});}
 
-  template<class Seq, class BinaryPred>
+  template<class Seq>
   size_t mismatch(Seq const &S1, Seq const &S2) {
     return find_if_index(std::min(S1.size(),S2.size()), [&] (size_t i) {
 	return S1[i] != S2[i];});}
@@ -1,4 +1,5 @@
 #include "sequence.h"
+#include "arena_allocator.h"
 #include "range_min.h"
 #include "get_time.h"
 
@@ -12,6 +13,7 @@ namespace pbbs {
     auto SA = SA_.slice(); // avoid bounds check
     using Uint = typename Seq2::value_type;
     timer t("LCP", false);
+    arena_scope scope; // for temporaries
     size_t len = 111;
     size_t n = SA.size();
     t.next("init");
@@ -27,14 +29,14 @@ namespace pbbs {
     t.next("head");
 
     // keep indices for which we do not yet know their LCP (i.e. LCP >= len)
-    sequence<Uint> remain = pack_index<Uint>(map(L, [&] (Uint l) {
+    sequence<Uint> remain = pack_index<Uint>(dmap(L, [&] (Uint l) {
 	  return l == n;}));
     t.next("pack");
 
     if (remain.size() == 0) return L;
 
     // an inverse permutation for SA
-    sequence<Uint> ISA_(n);
+    arena_sequence<Uint> ISA_(n);
     auto ISA = ISA_.slice(); // avoid bounds check
     parallel_for(0, n, [&] (size_t i) {
 	ISA[SA[i]] = i;});
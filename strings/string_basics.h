@@ -167,12 +167,11 @@ namespace pbbs {
   sequence<sequence<char>> tokensa(Seq const &S, UnaryPred const &is_space) {
     size_t n = S.size();
     if (n==0) return sequence<sequence<char>>();
-    sequence<bool> Flags(n+1);
-    parallel_for(1, n, [&] (long i) {
-	Flags[i] = is_space(S[i-1]) != is_space(S[i]);
-      }, 10000);
-    Flags[0] = !is_space(S[0]);
-    Flags[n] = !is_space(S[n-1]);
+    // delayed, so the flags are computed as pack_index reads them
+    auto Flags = delayed_seq<bool>(n+1, [&] (size_t i) {
+	if (i == 0) return !is_space(S[0]);
+	if (i == n) return !is_space(S[n-1]);
+	return is_space(S[i-1]) != is_space(S[i]);});
 
     sequence<long> Locations = pbbs::pack_index<long>(Flags);
   
@@ -185,15 +184,12 @@ namespace pbbs {
   tokens(Seq const &S, UnaryPred const &is_space) {
     size_t n = S.size();
     char* s = S.begin();
-    sequence<bool> Flags(n+1);
     if (n == 0) return sequence<sequence<char>>();
 
-    parallel_for(1, n, [&] (long i) {
-	Flags[i] = is_space(s[i-1]) != is_space(s[i]);
-      }, 10000);
-      
-    Flags[0] = !is_space(s[0]);
-    Flags[n] = !is_space(s[n-1]);
+    auto Flags = delayed_seq<bool>(n+1, [&] (size_t i) {
+	if (i == 0) return !is_space(s[0]);
+	if (i == n) return !is_space(s[n-1]);
+	return is_space(s[i-1]) != is_space(s[i]);});
 
     sequence<long> Locations = pbbs::pack_index<long>(Flags);
   
@@ -242,7 +238,7 @@ namespace pbbs {
   sequence<sequence<char>> split(Seq const &S, UnaryPred const &is_space) {
     size_t n = S.size();
 
-    auto X = sequence<bool>(n, [&] (size_t i) {
+    auto X = delayed_seq<bool>(n, [&] (size_t i) {
 	return is_space(S[i]);});
     sequence<long> Locations = pbbs::pack_index<long>(X);
     size_t m = Locations.size();
@@ -258,7 +254,7 @@ namespace pbbs {
     -> sequence<range<typename Seq::value_type *>> {
     size_t n = S.size();
 
-    auto X = sequence<bool>(n, [&] (size_t i) {
+    auto X = delayed_seq<bool>(n, [&] (size_t i) {
 	return is_space(S[i]);});
     sequence<long> Locations = pbbs::pack_index<long>(X);
     size_t m = Locations.size();
@@ -41,6 +41,7 @@
 #include "parallel.h"
 #include "get_time.h"
 #include "sample_sort.h"
+#include "arena_allocator.h"
 
 namespace pbbs {
 
@@ -87,7 +88,7 @@ namespace pbbs {
       segOut[l-1] = seg<indexT>(name+start,l-name);
 
     } else { // parallel version
-      sequence<indexT> names(l);
+      arena_sequence<indexT> names(l);
 
       // mark start of each segment with equal keys
       parallel_for (1, l, [&] (size_t i) {
@@ -117,7 +118,7 @@ namespace pbbs {
 		  sequence<indexT> &ranks,
 		  sequence<uint128> const &Cs) {
     size_t n = segOut.size();
-    sequence<indexT> names(n);
+    arena_sequence<indexT> names(n);
     size_t mask = ((((size_t) 1) << 32) - 1);
 
     // mark start of each segment with equal keys
@@ -149,6 +150,8 @@ namespace pbbs {
   template <class indexT>
   sequence<indexT> suffix_array(sequence<uchar> const &ss) {
     timer sa_timer("Suffix Array", false);
+    alloc_tag tag("suffix_array");
+    arena_scope scope; // for temporaries
     size_t n = ss.size();
 
     // renumber characters densely
@@ -162,7 +165,7 @@ namespace pbbs {
     std::tie(flags, m) = scan(flags, make_monoid(add,(indexT) 1));
 
     // pad the end of string with 0s
-    sequence<uchar> s(n + pad, [&] (size_t i) {
+    arena_sequence<uchar> s(n + pad, [&] (size_t i) {
 	return (i < n) ? flags[ss[i]] : 0;});
 
     if (verbose) cout << "distinct characters = " << m-1 << endl;
@@ -208,7 +211,7 @@ namespace pbbs {
       if (nSegs == 0) break;
       sa_timer.next("filter and scan");
 
-      sequence<indexT> offsets(nSegs);
+      arena_sequence<indexT> offsets(nSegs);
       parallel_for (0, nSegs, [&] (size_t i) {
 	  indexT start = Segs[i].start;
 	  indexT l = Segs[i].length;
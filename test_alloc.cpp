@@ -87,6 +87,24 @@ int main (int argc, char *argv[]) {
   t.next("delete allocator");
   cout << endl;
 
+  {
+    // bounds and trims the cache of large blocks
+    std::vector<size_t> sizes = {1 << 20, 1 << 22};
+    pool_allocator sa(sizes);
+    sa.set_large_cache_limit(5 << 22);
+    sequence<void*> b(16, [&] (size_t) {return sa.allocate(1 << 22);});
+    parallel_for (0, b.size(), [&] (size_t i) {
+	sa.deallocate(b[i], 1 << 22);}, 1);
+    auto s = sa.get_stats();
+    cout << "large allocated = " << s.large_allocated
+	 << ", cached = " << s.large_cached << " (limit "
+	 << s.large_cache_limit << ")" << endl;
+    sa.trim();
+    cout << "after trim, large allocated = " << sa.get_stats().large_allocated << endl;
+    t.next("large cache");
+  }
+  cout << endl;
+
   {
     block_allocator ba(64);
     t.next("initialize");
@@ -129,6 +147,28 @@ int main (int argc, char *argv[]) {
     //la::finish();
   }
   //t.next("clear allocator");
+  cout << endl;
+
+  {
+    // changes the number of workers between rounds
+    using T = std::array<long,8>;
+    using la = list_allocator<T>;
+    int p = num_workers();
+    for (int w : {2*p, 1, p}) {
+      set_num_workers(w);
+      sequence<char *> b(n, [&] (size_t i) {
+	  char* foo = (i & 1) ? (char*) my_alloc(48) : (char*) la::alloc();
+	  foo[0] = 'a';
+	  foo[1] = 0;
+	  return foo;
+	});
+      parallel_for (0,b.size(), [&] (size_t i) {
+	  if (i & 1) my_free(b[i]);
+	  else la::free((T*) b[i]);
+	});
+      t.next("alloc/free with " + std::to_string(w) + " workers");
+    }
+  }
   cout << endl;
   
     for (int j=0; j < rounds; j++) {
@@ -0,0 +1,116 @@
+#include "parse_command_line.h"
+#include "utilities.h"
+#include "sequence.h"
+#include "mmap_sequence.h"
+#include <fstream>
+#include <sys/resource.h>
+
+// Checks mmap_sequence on a temporary file: the length and elements
+// after create and open, that writes through a read_write mapping
+// persist, empty files, and that failed opens and maps throw.
+//    make test_mmap_sequence
+//    ./test_mmap_sequence [-n <size>] [-f <file>]
+
+int errors = 0;
+
+void check(bool ok, std::string what) {
+  if (!ok) {
+    cout << "ERROR: " << what << endl;
+    errors++;
+  }
+}
+
+template <typename F>
+bool throws(F f) {
+  try { f(); }
+  catch (std::runtime_error const &) { return true; }
+  return false;
+}
+
+size_t file_bytes(std::string const &name) {
+  struct stat sb;
+  if (stat(name.c_str(), &sb) == -1) return 0;
+  return sb.st_size;
+}
+
+int main (int argc, char *argv[]) {
+  commandLine P(argc, argv, "[-n <size>] [-f <file>]");
+  size_t n = P.getOptionLongValue("-n", 1000000);
+  std::string name = P.getOptionValue("-f", "/tmp/test_mmap_sequence.dat");
+  using ms = pbbs::mmap_sequence<long>;
+
+  pbbs::sequence<long> A(n, [] (size_t i) {return (long) (i * i);});
+  auto same = [&] (ms const &M, auto f) {
+    return M.size() == n &&
+      pbbs::find_if_index(n, [&] (size_t i) {return M[i] != f(i);}) == n;};
+
+  {
+    ms M = ms::create(name, A);
+    check(M.size() == n, "length after create");
+    check(same(M, [&] (size_t i) {return A[i];}), "elements after create");
+    M.flush();
+  }
+  check(file_bytes(name) == n * sizeof(long), "file length");
+
+  {
+    ms M = ms::open(name);
+    check(M.size() == n, "length after open");
+    check(same(M, [&] (size_t i) {return A[i];}), "elements after open");
+    check(pbbs::reduce(M, pbbs::addm<long>()) == pbbs::reduce(A, pbbs::addm<long>()),
+	  "reduce of a mapped sequence");
+    ms M2 = std::move(M);
+    check(M.size() == 0 && M2.size() == n, "move");
+  }
+
+  // writes go to the file once it is unmapped
+  {
+    ms M = ms::open(name, pbbs::read_write);
+    parallel_for(0, n, [&] (size_t i) {M[i] = -A[i];});
+  }
+  {
+    ms M = ms::open(name);
+    check(same(M, [&] (size_t i) {return -A[i];}), "writes persist");
+  }
+
+  // empty files are not mapped
+  {
+    ms E = ms::create(name, 0);
+    check(E.size() == 0 && E.begin() == NULL, "create empty");
+  }
+  check(file_bytes(name) == 0, "empty file length");
+  {
+    ms E = ms::open(name, pbbs::read_write);
+    check(E.size() == 0 && E.begin() == E.end(), "open empty");
+  }
+
+  // failures
+  check(throws([&] () {ms::open("/nonexistent/mmap_sequence");}),
+	"open of a missing file");
+  check(throws([&] () {ms::create("/nonexistent/mmap_sequence", 10);}),
+	"create in a missing directory");
+  check(throws([&] () {ms::open("/tmp");}), "open of a directory");
+  {
+    std::ofstream out(name, std::ios::trunc);
+    out << "abc";
+  }
+  check(throws([&] () {ms::open(name);}), "open of a partial element");
+
+  // mmap fails when the address space limit leaves no room for the file
+  if (truncate(name.c_str(), ((size_t) 1) << 32) == 0) {
+    struct rlimit saved;
+    getrlimit(RLIMIT_AS, &saved);
+    size_t pages = 0;
+    std::ifstream statm("/proc/self/statm");
+    statm >> pages;
+    struct rlimit low = saved;
+    low.rlim_cur = pages * sysconf(_SC_PAGESIZE) + (((size_t) 1) << 26);
+    if (setrlimit(RLIMIT_AS, &low) == 0) {
+      check(throws([&] () {ms::open(name);}), "mmap beyond the address space limit");
+      setrlimit(RLIMIT_AS, &saved);
+    }
+  }
+
+  unlink(name.c_str());
+  if (errors == 0) cout << "mmap_sequence: all checks passed" << endl;
+  return errors > 0;
+}
@@ -1,6 +1,7 @@
 #include "get_time.h"
 #include "parse_command_line.h"
 #include "utilities.h"
+#include "future.h"
 
 long fib(long i) {
   if (i <= 1) return 1;
@@ -11,11 +12,21 @@ long fib(long i) {
   return l + r;
 }
 
+// skewed recursion that leaves depth many jobs on one deque
+long deep(long depth) {
+  if (depth == 0) return 0;
+  long l,r;
+  par_do([&] () { l = deep(depth-1);},
+	 [&] () { r = 1;});
+  return l + r;
+}
+
 int main (int argc, char *argv[]) {
-  commandLine P(argc, argv, "[-n <size>] [-p <threads>]");
+  commandLine P(argc, argv, "[-n <size>] [-p <threads>] [-d <depth>] [-trace <file>]");
   size_t n = P.getOptionLongValue("-n", 45);
   size_t m = P.getOptionLongValue("-m", 100000000);
   size_t p = P.getOptionLongValue("-p", 0);
+  size_t d = P.getOptionLongValue("-d", 10000);
 
   auto job = [&] () {
     timer t;
@@ -55,7 +66,84 @@ int main (int argc, char *argv[]) {
     t2.next("map spin");
   };
   parallel_run(job3,p);
-}
-  
-  
 
+  auto job4 = [&] () {
+    timer t;
+    long r = deep(d);
+    t.next("deep");
+    cout << "depth: " << r << endl;
+  };
+  parallel_run(job4,p);
+
+  // futures, including waiting on one inside a par_do
+  auto job5 = [&] () {
+    timer t;
+    std::vector<pbbs::future<long>> fs;
+    for (int i=0; i < 8; i++)
+      fs.push_back(pbbs::spawn([&] () {return fib(n-4);}));
+    long l, r;
+    par_do([&] () { auto f = pbbs::spawn([&] () {return fib(n-4);});
+		    l = fib(n-5) + f.get();},
+	   [&] () { r = fib(n-6);});
+    auto all = pbbs::when_all(std::move(fs)).get();
+    long total = l + r;
+    for (long x : all) total += x;
+    t.next("futures");
+    cout << "futures: " << total << " (should be " << 10*fib(n-4) << ")" << endl;
+  };
+  parallel_run(job5,p);
+
+  // a future waiting on a future, combined by when_all, so a waiting
+  // thread must not run a job that waits on a frame under it
+  auto job5b = [&] () {
+    timer t;
+    long total = 0;
+    for (int i=0; i < 20; i++) {
+      auto f1 = pbbs::spawn([&] () {
+	  auto g = pbbs::spawn([&] () {return fib(n-10);});
+	  return g.get();});
+      auto f2 = pbbs::spawn([&] () {return fib(n-10);});
+      auto all = pbbs::when_all(std::move(f1), std::move(f2)).get();
+      total += std::get<0>(all) + std::get<1>(all);
+    }
+    t.next("nested futures");
+    cout << "nested futures: " << total << " (should be " << 40*fib(n-10) << ")" << endl;
+  };
+  parallel_run(job5b,p);
+
+  // high priority queries while a batch job runs
+  auto job6 = [&] () {
+    auto query = [&] () {
+      timer t;
+      long r;
+      with_priority(high_priority, [&] () {r = fib(n-8);});
+      return std::make_pair(r, t.stop());
+    };
+    double alone = query().second;
+    auto batch = pbbs::spawn([&] () {
+	for (int i=0; i < 20; i++) parallel_for(0,m/200,spin);});
+    double max_busy = 0;
+    for (int i=0; i < 10; i++) max_busy = std::max(max_busy, query().second);
+    batch.get();
+    cout << "query alone: " << alone << ", max during batch: " << max_busy << endl;
+  };
+  parallel_run(job6,p);
+
+#if defined(RACE_CHECK)
+  // make test_scheduler_RC, the above should have no races, and a
+  // histogram with unprotected increments should
+  size_t races = race_check::num_races();
+  cout << "races found: " << races << endl;
+  std::vector<int> counts(16, 0);
+  parallel_for(0, 1000, [&] (size_t i) {counts[i % 16]++;});
+  cout << "injected race " << ((race_check::num_races() > races) ?
+			       "found" : "NOT FOUND") << endl;
+#endif
+
+#if defined(HOMEGROWN) && defined(SCHEDULER_STATS)
+  // make test_scheduler_HGSTATS
+  fj.print_stats();
+  char* trace_file = P.getOptionValue("-trace");
+  if (trace_file) fj.write_trace(trace_file);
+#endif
+}
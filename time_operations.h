@@ -29,6 +29,19 @@ using uchar = unsigned char;
   _body;		    \
   double _var = bt.stop();
 
+template<typename T>
+bool check_equal(pbbs::sequence<T> const &a, pbbs::sequence<T> const &b,
+		 std::string name) {
+  size_t n = std::min(a.size(), b.size());
+  size_t err_loc = pbbs::find_if_index(n, [&] (size_t i) {return a[i] != b[i];});
+  if (a.size() != b.size() || err_loc != n) {
+    cout << "ERROR in " << name << " at location " << err_loc
+	 << ", sizes " << a.size() << " and " << b.size() << endl;
+    return false;
+  }
+  return true;
+}
+
 template<typename T>
 double t_tabulate(size_t n, bool) {
   auto f = [] (size_t i) {return i;};
@@ -87,6 +100,60 @@ double t_scan_add_seq(size_t n, bool) {
   return t;
 }
 
+// x -> a*x + b (mod 2^64), composed in order by a monoid that is not
+// commutative, for checking that the scans keep the order
+struct affine {
+  unsigned long a, b;
+  bool operator!=(affine const &y) const {return a != y.a || b != y.b;}
+};
+struct affine_compose {
+  using T = affine;
+  T identity = {1, 0};
+  T f(T x, T y) const {return {x.a * y.a, y.a * x.b + y.b};}
+};
+
+// checks the single pass scan against the two pass scan, exclusive
+// and inclusive, into a new sequence and in place
+template<typename T, typename Monoid>
+void check_scan_single_pass(pbbs::sequence<T> const &In, Monoid m,
+			    std::string name) {
+  auto sp = pbbs::fl_scan_single_pass, tp = pbbs::fl_scan_two_pass;
+  for (auto inc : {pbbs::no_flag, pbbs::fl_scan_inclusive}) {
+    pbbs::sequence<T> S, S2;
+    T total, total2;
+    std::tie(S, total) = pbbs::scan(In, m, sp | inc);
+    std::tie(S2, total2) = pbbs::scan(In, m, tp | inc);
+    check_equal(S, S2, name + " single pass scan");
+    if (total != total2) cout << "ERROR in " << name << " single pass scan total" << endl;
+    pbbs::sequence<T> I = In;
+    total = pbbs::scan_inplace(I.slice(), m, sp | inc);
+    check_equal(I, S2, name + " single pass scan inplace");
+    if (total != total2) cout << "ERROR in " << name << " single pass scan inplace total" << endl;
+  }
+}
+
+template<typename T>
+double t_scan_single_pass(size_t n, bool check) {
+  pbbs::sequence<T> In(n, (T) 1);
+  pbbs::sequence<T> Out;
+  T sum;
+  time(t, std::tie(Out,sum) = pbbs::scan(In, pbbs::addm<T>(), pbbs::fl_scan_single_pass););
+  if (check) {
+    pbbs::random r(0);
+    pbbs::sequence<T> A(n, [&] (size_t i) {return (T) (r.ith_rand(i) % 1000);});
+    check_scan_single_pass(A, pbbs::addm<T>(), "add");
+    pbbs::sequence<affine> F(n, [&] (size_t i) {
+	return affine{r.ith_rand(2*i) | 1, r.ith_rand(2*i+1)};});
+    check_scan_single_pass(F, affine_compose(), "affine");
+    // not exact, so by default the deterministic two pass scan
+    pbbs::sequence<double> D(n, [&] (size_t i) {return 1.0 / (1 + A[i]);});
+    double d = pbbs::scan(D, pbbs::addm<double>()).second;
+    double d2 = pbbs::scan(D, pbbs::addm<double>(), pbbs::fl_scan_two_pass).second;
+    if (d != d2) cout << "ERROR in default double scan, not two pass" << endl;
+  }
+  return t;
+}
+
 template<typename T>
 double t_pack(size_t n, bool) {
   pbbs::sequence<bool> flags(n, [] (size_t i) -> bool {return i%2;});
@@ -95,6 +162,55 @@ double t_pack(size_t n, bool) {
   return t;
 }
 
+// the check also covers sizes around the 64 element words of the flags
+template<typename T>
+double t_filter(size_t n, bool check) {
+  pbbs::random r(0);
+  pbbs::sequence<T> In(n, [&] (size_t i) -> T {return r.ith_rand(i)%n;});
+  auto p = [&] (T x) {return x < (T) (n/3);};
+  pbbs::sequence<T> Out;
+  time(t, Out = pbbs::filter(In, p););
+  if (check) {
+    for (size_t m : {n, (size_t) 0, (size_t) 1, (size_t) 63, (size_t) 64,
+	  (size_t) 65, (size_t) 1000, (size_t) 1025, (size_t) 70001}) {
+      if (m > n) continue;
+      auto A = In.slice(0, m);
+      pbbs::sequence<bool> flags(m, [&] (size_t i) {return p(A[i]);});
+      auto expected = pbbs::pack(A, flags);
+      check_equal(pbbs::filter(A, p), expected, "filter");
+      pbbs::sequence<T> Out2(m);
+      size_t k = pbbs::filter_out(A, Out2.slice(), p);
+      check_equal(pbbs::sequence<T>(Out2.slice(0, k)), expected, "filter_out");
+    }
+  }
+  return t;
+}
+
+template<typename T>
+double t_dfilter(size_t n, bool check) {
+  pbbs::random r(0);
+  pbbs::sequence<T> In(n, [&] (size_t i) -> T {return r.ith_rand(i)%n;});
+  auto p = [&] (T x) {return x < (T) (n/3);};
+  auto m = pbbs::addm<T>();
+  T sum;
+  time(t, sum = pbbs::reduce(pbbs::dfilter(In, p), m););
+  if (check) {
+    auto Fl = pbbs::filter(In, p);
+    if (sum != pbbs::reduce(Fl, m))
+      cout << "ERROR in dfilter reduce" << endl;
+    check_equal(pbbs::to_sequence(pbbs::dfilter(In, p)), Fl, "dfilter to_sequence");
+    pbbs::sequence<T> S, Se;
+    T total, total_e;
+    for (auto fl : {pbbs::no_flag, pbbs::fl_scan_inclusive}) {
+      std::tie(S, total) = pbbs::scan(pbbs::dfilter(In, p), m, fl);
+      std::tie(Se, total_e) = pbbs::scan(Fl, m, fl);
+      check_equal(S, Se, "dfilter scan");
+      if (total != total_e) cout << "ERROR in dfilter scan total" << endl;
+    }
+  }
+  return t;
+}
+
 template<typename T>
 double t_split3_old(size_t n, bool) {
   pbbs::sequence<uchar> flags(n, [] (size_t i) -> uchar {return i%3;});
@@ -124,9 +240,8 @@ double t_partition(size_t n, bool) {
   return t;
 }
 
-#if defined(CILK)
 #include "reducer.h"
-double t_histogram_reducer(size_t n, bool) {
+double t_histogram_reducer(size_t n, bool check) {
   pbbs::random r(0);
   constexpr int count = 1024;
   histogram_reducer<int,count> red;
@@ -134,14 +249,14 @@ double t_histogram_reducer(size_t n, bool) {
   pbbs::sequence<aa> In(n, [&] (size_t i) {aa x; x[0] = r.ith_rand(i) % count; return x;});
   auto f = [&] (size_t i) { red->add_value(In[i][0]);};
   time(t, parallel_for(0, n, f););
-  //cout << red.get_value()[0] << endl;
+  if (check) {
+    auto counts = red.get_value();
+    size_t total = 0;
+    for (int i=0; i < count; i++) total += counts[i];
+    if (total != n) cout << "ERROR in histogram reducer, total " << total << endl;
+  }
   return t;
 }
-#else
-double t_histogram_reducer(size_t, bool) {
-  return 1.0;
-}
-#endif
 
 template<typename T>
 double t_gather(size_t n, bool) {
@@ -98,7 +98,7 @@ double pick_test(size_t id, size_t n, size_t rounds,
   case 2:
     return run_multiple(n,rounds,ebytes(8,0),"reduce add long", t_reduce_add<long>, half_length);
   case 3:
-    return run_multiple(n,rounds,ebytes(24,8),"scan add long", t_scan_add<long>, half_length);
+    return run_multiple(n,rounds,ebytes(16,8),"scan add long", t_scan_add<long>, half_length);
   case 4:
     return run_multiple(n,rounds,ebytes(14,4),"pack long", t_pack<long>, half_length);
   case 5:
@@ -169,6 +169,12 @@ double pick_test(size_t id, size_t n, size_t rounds,
     return run_multiple(n,rounds,ebytes(24,8),"scan add long seq", t_scan_add_seq<long>, half_length);
   case 52:
     return run_multiple(n,rounds,1, "range_min long", t_range_min<long>, half_length, "Gelts/sec");
+  case 53:
+    return run_multiple(n,rounds,ebytes(16,4),"filter long", t_filter<long>, half_length);
+  case 54:
+    return run_multiple(n,rounds,ebytes(8,0),"dfilter reduce long", t_dfilter<long>, half_length);
+  case 55:
+    return run_multiple(n,rounds,ebytes(16,8),"scan add long single pass", t_scan_single_pass<long>, half_length);
   default:
     assert(false);
     return 0.0 ;
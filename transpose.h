@@ -128,9 +128,9 @@ namespace pbbs {
   // From and To are of lenght n
   // counts is of length num_blocks * num_buckets
   // Data is memcpy'd into To avoiding initializers and overloaded =
-  template<typename E, typename s_size_t>
+  template<typename E, typename s_size_t, typename Alloc>
   sequence<size_t> transpose_buckets(E* From, E* To,
-				     sequence<s_size_t> const & counts,
+				     sequence<s_size_t, Alloc> const & counts,
 				     size_t n,
 				     size_t block_size,
 				     size_t num_blocks,
@@ -20,10 +20,17 @@ static void par_do_if(bool do_parallel, Lf left, Rf right, bool cons=false) {
   else {left(); right();}
 }
 
+// runs all the thunks in parallel as a single k-way fork
+template <typename... Fs>
+inline void parallel_invoke(Fs... fs) {
+  par_do_n(sizeof...(Fs), [&] (size_t i) {
+      size_t j = 0;
+      ((j++ == i ? (void) fs() : (void) 0), ...);});
+}
+
 template <typename Lf, typename Mf, typename Rf >
 inline void par_do3(Lf left, Mf mid, Rf right) {
-  auto left_mid = [&] () {par_do(left,mid);};
-  par_do(left_mid, right);
+  parallel_invoke(left, mid, right);
 }
 
 template <typename Lf, typename Mf, typename Rf >